@@ -0,0 +1,75 @@
+"use strict";
+
+function row(table, name, value, cls) {
+  var tr = table.insertRow();
+  tr.insertCell().textContent = name;
+  var td = tr.insertCell();
+  td.textContent = value;
+  td.className = "v" + (cls ? " " + cls : "");
+}
+
+function sensorError(s) {
+  if (s.status == -100)
+    return "Timed out waiting for measurement";
+  if (s.status <= -200)
+    return "Failed to read data (" + (s.status + 200) + ")";
+  if (s.status == -300)
+    return "Not sampled yet";
+  return "Failed to set mode (" + s.status + ")";
+}
+
+var last;
+
+function render(st) {
+  last = st;
+  var status = document.getElementById("status");
+  status.textContent = "";
+  row(status, "Hostname", st.hostname);
+  row(status, "IP address", st.ip);
+  row(status, "MAC address", st.mac);
+  row(status, "Uptime", Math.floor(st.uptime) + " s");
+
+  var sensors = document.getElementById("sensors");
+  sensors.textContent = "";
+  st.sensors.forEach(function(s) {
+    var h = document.createElement("h3");
+    h.textContent = "Sensor " + s.id;
+    sensors.appendChild(h);
+    var t = document.createElement("table");
+    if (s.status != 0)
+      row(t, "Error", sensorError(s), "err");
+    if ("temperature" in s) {
+      row(t, "Temperature", s.temperature.toFixed(2) + " °C");
+      row(t, "Pressure", (s.pressure / 100).toFixed(2) + " hPa");
+      row(t, "Humidity", s.humidity.toFixed(2) + " %RH");
+      row(t, "Sample age", Math.round(s.age) + " s");
+    }
+    sensors.appendChild(t);
+  });
+  document.getElementById("age").textContent =
+    "Updated " + new Date().toLocaleTimeString();
+}
+
+function update() {
+  fetch("/status.json")
+    .then(function(r) { return r.json(); })
+    .then(render)
+    .catch(function(e) {
+      document.getElementById("age").textContent = "Update failed: " + e;
+    });
+}
+
+update();
+if (window.EventSource) {
+  // New samples are pushed as they are taken, poll only for the rest
+  var es = new EventSource("/events");
+  es.addEventListener("sample", function(e) {
+    if (!last)
+      return;
+    last.sensors = JSON.parse(e.data).sensors;
+    render(last);
+  });
+  setInterval(update, 60000);
+} else {
+  setInterval(update, 10000);
+}
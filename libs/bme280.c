@@ -584,6 +584,45 @@ int8_t bme280_is_busy(const struct bme280_dev *dev)
 	return 0;
 }
 
+/*!
+ * @brief This API computes the maximum measurement time of a forced mode
+ * conversion with the given oversampling settings.
+ */
+ICACHE_FLASH_ATTR
+uint32_t bme280_cal_meas_delay(const struct bme280_settings *settings)
+{
+	uint32_t max_delay;
+	uint8_t temp_osr;
+	uint8_t pres_osr;
+	uint8_t hum_osr;
+
+	/* Array to map OSR config register value to actual OSR */
+	const uint8_t osr_sett_to_act_osr[] = {0, 1, 2, 4, 8, 16};
+
+	/* Mapping osr settings to the actual osr values e.g. 0b101 -> osr X16 */
+	if (settings->osr_t <= 5)
+		temp_osr = osr_sett_to_act_osr[settings->osr_t];
+	else
+		temp_osr = 16;
+
+	if (settings->osr_p <= 5)
+		pres_osr = osr_sett_to_act_osr[settings->osr_p];
+	else
+		pres_osr = 16;
+
+	if (settings->osr_h <= 5)
+		hum_osr = osr_sett_to_act_osr[settings->osr_h];
+	else
+		hum_osr = 16;
+
+	max_delay = (uint32_t)((BME280_MEAS_OFFSET + (BME280_MEAS_DUR * temp_osr) +
+		((BME280_MEAS_DUR * pres_osr) + BME280_PRES_HUM_MEAS_OFFSET) +
+		((BME280_MEAS_DUR * hum_osr) + BME280_PRES_HUM_MEAS_OFFSET) +
+		BME280_MEAS_SCALING_FACTOR - 1) / BME280_MEAS_SCALING_FACTOR);
+
+	return max_delay;
+}
+
 /*!
  * @brief This API performs the soft reset of the sensor.
  */
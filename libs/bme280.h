@@ -175,6 +175,16 @@ int8_t bme280_get_sensor_mode(uint8_t *sensor_mode, const struct bme280_dev *dev
 
 int8_t bme280_is_busy(const struct bme280_dev *dev);
 
+/*!
+ * @brief This API computes the maximum measurement time of a forced mode
+ * conversion with the given oversampling settings.
+ *
+ * @param[in] settings : Structure instance of bme280_settings.
+ *
+ * @return Maximum measurement time in milliseconds (rounded up)
+ */
+uint32_t bme280_cal_meas_delay(const struct bme280_settings *settings);
+
 /*!
  * @brief This API performs the soft reset of the sensor.
  *
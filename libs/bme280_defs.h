@@ -137,6 +137,12 @@
 #define BME280_CONFIG_ADDR					UINT8_C(0xF5)
 #define BME280_DATA_ADDR					UINT8_C(0xF7)
 
+/**\name Measurement delay calculation macros (datasheet section 9.1) */
+#define BME280_MEAS_OFFSET				UINT16_C(1250)
+#define BME280_MEAS_DUR					UINT16_C(2300)
+#define BME280_PRES_HUM_MEAS_OFFSET		UINT16_C(575)
+#define BME280_MEAS_SCALING_FACTOR		UINT16_C(1000)
+
 /**\name API success code */
 #define BME280_OK					INT8_C(0)
 
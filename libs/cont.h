@@ -37,6 +37,14 @@ typedef struct cont_ {
         unsigned* sp_yield;
 
         unsigned* stack_end;
+#ifdef CONT_SHARED_STACK
+        // All continuations run on one shared stack. While suspended, the
+        // live part of it is kept in a heap buffer of exactly that size.
+        unsigned* saved;
+        unsigned saved_size;
+        // Deepest stack use seen in any run of this continuation
+        unsigned used_max;
+#else
         unsigned unused1;
         unsigned unused2;
         unsigned stack_guard1;
@@ -45,16 +53,17 @@ typedef struct cont_ {
 
         unsigned stack_guard2;
         unsigned* struct_start;
+#endif
 } cont_t;
 
-extern cont_t* g_pcont;
-
 // Initialize the cont_t structure before calling cont_run
 void cont_init(cont_t*);
 
 // Run function pfn in a separate stack, or continue execution
-// at the point where cont_yield was called
-void cont_run(cont_t*, void (*pfn)(void *arg), void *arg);
+// at the point where cont_yield was called. Returns 0, or -1 if nothing
+// ran because the shared stack (CONT_SHARED_STACK) holds the frames of
+// another continuation; the caller has to try again later.
+int cont_run(cont_t*, void (*pfn)(void *arg), void *arg);
 
 // Return to the point where cont_run was called, saving the
 // execution state (registers and stack)
@@ -66,8 +75,14 @@ int cont_check(cont_t* cont);
 
 // Go through stack and check how many bytes are most probably still unchanged
 // and thus weren't used by the user code. i.e. that stack space is free. (high water mark)
+// With CONT_SHARED_STACK, the stack is scanned after every run and
+// re-filled below the live frames, so this is per continuation as well.
 int cont_get_free_stack(cont_t* cont);
 
+// Free the saved stack of a continuation that will never be resumed.
+// Only needed with CONT_SHARED_STACK.
+void cont_release(cont_t* cont);
+
 // Check if yield() may be called. Returns true if we are running inside
 // continuation stack
 int cont_can_yield(cont_t* cont);
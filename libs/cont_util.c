@@ -21,9 +21,13 @@
 #include <string.h>
 #include "cont.h"
 #include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
 
 #define CONT_STACKGUARD 0xfeefeffe
 
+#ifndef CONT_SHARED_STACK
+
 void cont_init(cont_t* cont) {
     memset(cont, 0, sizeof(cont_t));
 
@@ -57,3 +61,140 @@ int cont_get_free_stack(cont_t* cont) {
 
     return freeWords * 4;
 }
+
+void cont_release(cont_t* cont) {
+}
+
+#else /* CONT_SHARED_STACK */
+
+// Same layout as the tail of the unshared cont_t: cont_norm finds the
+// running continuation in the word after stack_end
+static struct {
+    unsigned stack_guard1;
+    unsigned stack[CONT_STACKSIZE / 4];
+    unsigned stack_guard2;
+    cont_t* current;
+} cont_stack;
+
+// Continuation whose frames are live on the shared stack: the running one,
+// or a suspended one whose stack could not be saved
+static cont_t* cont_owner;
+
+void cont_switch(cont_t*, void (*pfn)(void *arg), void *arg);
+
+static void cont_fill(unsigned* from, unsigned* to) {
+    while(from < to)
+        *from++ = CONT_STACKGUARD;
+}
+
+// Give up the stack held by a continuation that will never resume. Its
+// frames are dead, so they are cleared for the next high-water scan.
+static void cont_disown(cont_t* cont) {
+    if (cont_owner != cont)
+        return;
+    // Not while it is running on it
+    if (cont->pc_yield)
+        cont_fill(cont_stack.stack, cont->stack_end);
+    cont_owner = NULL;
+}
+
+void cont_init(cont_t* cont) {
+    cont_disown(cont);
+    memset(cont, 0, sizeof(cont_t));
+
+    // Only the first time: later calls may come while another
+    // continuation's frames are on the stack
+    if (cont_stack.stack_guard1 != CONT_STACKGUARD) {
+        for(int pos = 0; pos < (int)(sizeof(cont_stack.stack) / 4); pos++)
+        {
+            cont_stack.stack[pos] = CONT_STACKGUARD;
+        }
+    }
+    cont_stack.stack_guard1 = CONT_STACKGUARD;
+    cont_stack.stack_guard2 = CONT_STACKGUARD;
+    cont->stack_end = cont_stack.stack + (sizeof(cont_stack.stack) / 4);
+}
+
+// Record how deep the last run went, then put the magic values back below
+// the frames still live (none if it finished) for the next run. Only the
+// part the run dirtied needs re-filling. While no continuation owns the
+// stack it holds nothing but magic values, so each scan only sees the
+// frames of the continuation that just ran.
+static void cont_update_used(cont_t* cont) {
+    unsigned* head = cont_stack.stack;
+    unsigned* live = cont->pc_yield ? cont->sp_yield : cont->stack_end;
+
+    while(head < live && *head == CONT_STACKGUARD)
+        head++;
+
+    unsigned used = (cont->stack_end - head) * 4;
+    if (used > cont->used_max)
+        cont->used_max = used;
+
+    cont_fill(head, live);
+}
+
+int cont_run(cont_t* cont, void (*pfn)(void *arg), void *arg) {
+    if (cont_owner && cont_owner != cont) {
+        // Nested runs or a pinned stack; up to the caller to retry
+        os_printf("cont_run: shared stack busy\n");
+        return -1;
+    }
+
+    if (!cont_owner && cont->pc_yield) {
+        memcpy(cont->sp_yield, cont->saved, cont->saved_size);
+    }
+    cont_owner = cont;
+    cont_stack.current = cont;
+
+    cont_switch(cont, pfn, arg);
+    cont_update_used(cont);
+
+    if (!cont->pc_yield) {
+        // Finished
+        cont_release(cont);
+        cont_owner = NULL;
+        return 0;
+    }
+
+    unsigned size = (cont->stack_end - cont->sp_yield) * 4;
+    if (size != cont->saved_size) {
+        if (cont->saved)
+            os_free(cont->saved);
+        cont->saved = os_malloc(size);
+        cont->saved_size = cont->saved ? size : 0;
+    }
+    if (!cont->saved) {
+        // Keep the frames where they are until this continuation resumes
+        os_printf("cont_run: no memory to save %d byte stack\n", size);
+        return 0;
+    }
+    memcpy(cont->saved, cont->sp_yield, size);
+    cont_fill(cont->sp_yield, cont->stack_end);
+    cont_owner = NULL;
+    return 0;
+}
+
+int cont_check(cont_t* cont) {
+    if(cont_stack.stack_guard1 != CONT_STACKGUARD || cont_stack.stack_guard2 != CONT_STACKGUARD) return 1;
+
+    return 0;
+}
+
+int cont_get_free_stack(cont_t* cont) {
+    return sizeof(cont_stack.stack) - cont->used_max;
+}
+
+void cont_release(cont_t* cont) {
+    if (cont->saved)
+        os_free(cont->saved);
+    cont->saved = NULL;
+    cont->saved_size = 0;
+    cont_disown(cont);
+}
+
+#endif /* CONT_SHARED_STACK */
+
+int cont_can_yield(cont_t* cont) {
+    return cont->pc_ret != 0 && cont->pc_yield == 0;
+}
@@ -89,6 +89,7 @@ int vsnprintf(char* buffer, size_t count, const char* format, va_list va);
  * \return The number of characters that are sent to the output function, not counting the terminating null character
  */
 int fctprintf(void (*out)(char character, void* arg), void* arg, const char* format, ...);
+int vfctprintf(void (*out)(char character, void* arg), void* arg, const char* format, va_list va);
 
 
 #ifdef __cplusplus
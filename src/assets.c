@@ -0,0 +1,47 @@
+#include "ets_sys.h"
+#include "osapi.h"
+
+#include "httpserver.h"
+#include "assets.h"
+
+ICACHE_FLASH_ATTR
+const struct asset *assets_find(const char *path)
+{
+    for (uint32_t i = 0; i < asset_count; i++) {
+        if (!strcmp(path, assets[i].path))
+            return &assets[i];
+    }
+    return NULL;
+}
+
+ICACHE_FLASH_ATTR
+void assets_handle(httpconn_t *conn, char *path, char *query_string)
+{
+    const struct asset *a = assets_find(path);
+
+    if (!a) {
+        httpserver_handle_404(conn, path, query_string);
+        return;
+    }
+
+    // Accept-Encoding is only known once the headers have been read
+    httpserver_end_request(conn);
+    int gzip = a->gz_data && httpserver_accepts_gzip(conn);
+
+    if (httpserver_conditional(conn, gzip ? a->gz_etag : a->etag, 0))
+        return;
+
+    httpserver_start_response(conn, 200, "OK");
+    httpserver_send_header(conn, "Content-Type", a->content_type);
+    if (a->gz_data)
+        httpserver_send_header(conn, "Vary", "Accept-Encoding");
+    if (gzip)
+        httpserver_send_header(conn, "Content-Encoding", "gzip");
+    httpserver_send_content_length(conn, gzip ? a->gz_length : a->length);
+    httpserver_end_headers(conn);
+
+    if (gzip)
+        httpserver_write_static(conn, a->gz_data, a->gz_length);
+    else
+        httpserver_write_static(conn, a->data, a->length);
+}
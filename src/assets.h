@@ -0,0 +1,24 @@
+#include "httpserver.h"
+
+// Static files from assets/, built into flash by tools/mkassets.py. The
+// table and the data live in flash, so only whole aligned words may be
+// read from them directly; every field is 32 bits wide for that reason.
+struct asset {
+    const char *path;
+    const char *content_type;
+    const uint8_t *data;
+    uint32_t length;
+    // Gzipped variant, NULL if compressing did not help
+    const uint8_t *gz_data;
+    uint32_t gz_length;
+    // Derived from the content, for conditional requests
+    const char *etag;
+    const char *gz_etag;
+};
+
+extern const struct asset assets[];
+extern const uint32_t asset_count;
+
+const struct asset *assets_find(const char *path);
+// Handler for / and /assets/*
+void assets_handle(httpconn_t *conn, char *path, char *query_string);
@@ -0,0 +1,84 @@
+#include "ets_sys.h"
+#include "osapi.h"
+
+#include "contwait.h"
+
+// How long to wait before trying again when the shared stack is busy
+#define CONTWAIT_RETRY_MS 50
+
+static contwait_t *cw_current;
+
+ICACHE_FLASH_ATTR
+static void contwait_timeout(void *arg)
+{
+    contwait_t *cw = arg;
+
+    cw->sleeping = 0;
+    cw->wake(cw->arg);
+}
+
+ICACHE_FLASH_ATTR
+void contwait_init(contwait_t *cw, cont_t *cont, contwait_wake_t wake, void *arg)
+{
+    os_timer_disarm(&cw->timer);
+    cw->cont = cont;
+    cw->wake = wake;
+    cw->arg = arg;
+    cw->sleeping = 0;
+    os_timer_setfn(&cw->timer, contwait_timeout, cw);
+}
+
+ICACHE_FLASH_ATTR
+int contwait_run(contwait_t *cw, void (*pfn)(void *arg), void *arg)
+{
+    contwait_t *prev = cw_current;
+    int ret;
+
+    cw_current = cw;
+    ret = cont_run(cw->cont, pfn, arg);
+    cw_current = prev;
+
+    // Refused: have the wake callback try again. A pending sleep timeout
+    // will do that already.
+    if (ret < 0 && !cw->sleeping) {
+        os_timer_disarm(&cw->timer);
+        os_timer_arm(&cw->timer, CONTWAIT_RETRY_MS, 0);
+    }
+    return ret;
+}
+
+ICACHE_FLASH_ATTR
+void contwait_cancel(contwait_t *cw)
+{
+    os_timer_disarm(&cw->timer);
+    cw->sleeping = 0;
+}
+
+ICACHE_FLASH_ATTR
+void contwait_wake(contwait_t *cw)
+{
+    // A sleep must last at least as long as asked
+    if (cw->sleeping)
+        return;
+    os_timer_disarm(&cw->timer);
+    os_timer_arm(&cw->timer, 0, 0);
+}
+
+ICACHE_FLASH_ATTR
+int contwait_can_sleep(void)
+{
+    return cw_current && cont_can_yield(cw_current->cont);
+}
+
+ICACHE_FLASH_ATTR
+void contwait_sleep_ms(uint32_t ms)
+{
+    contwait_t *cw = cw_current;
+
+    cw->sleeping = 1;
+    os_timer_disarm(&cw->timer);
+    os_timer_arm(&cw->timer, ms, 0);
+    // Other events (e.g. incoming data) may resume us early, keep waiting
+    while (cw->sleeping)
+        cont_yield(cw->cont);
+}
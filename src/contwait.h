@@ -0,0 +1,31 @@
+#include "os_type.h"
+#include "cont.h"
+
+// Timer-backed sleeping for continuations. The owner of a cont_t embeds a
+// contwait_t next to it, runs the continuation through contwait_run(), and
+// gets its wake callback invoked when a sleep expires so it can resume the
+// continuation from the SDK task context.
+
+typedef void (*contwait_wake_t)(void *arg);
+
+typedef struct contwait {
+    cont_t *cont;
+    contwait_wake_t wake;
+    void *arg;
+    os_timer_t timer;
+    int sleeping;
+} contwait_t;
+
+void contwait_init(contwait_t *cw, cont_t *cont, contwait_wake_t wake, void *arg);
+// Returns -1 if the continuation could not run now (shared stack busy); the
+// wake callback is then invoked again later to retry.
+int contwait_run(contwait_t *cw, void (*pfn)(void *arg), void *arg);
+void contwait_cancel(contwait_t *cw);
+// Have the wake callback run soon from the SDK task context, e.g. to resume
+// a continuation waiting for an event. Does nothing while it is sleeping.
+void contwait_wake(contwait_t *cw);
+
+// Returns true if called from a continuation started with contwait_run()
+int contwait_can_sleep(void);
+// Yield the current continuation until at least ms milliseconds have passed
+void contwait_sleep_ms(uint32_t ms);
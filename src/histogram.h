@@ -0,0 +1,44 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "c_types.h"
+
+// Latency histogram with buckets growing by a factor of 4 from 128 us:
+// bucket k counts durations of at most 2^(7 + 2k) microseconds (up to
+// about 33 s), the last one everything longer. Finer buckets would mostly
+// stay empty and only make /metrics longer. Recording is a clz and a few
+// increments, so it can sit on hot paths; the cumulative Prometheus form
+// is only computed when exported.
+#define HISTOGRAM_MIN_SHIFT 7
+#define HISTOGRAM_STEP_SHIFT 2
+#define HISTOGRAM_BUCKETS 11
+
+struct histogram {
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint64_t sum_us;
+};
+
+// Upper bound of bucket k, for all but the last
+static inline uint32_t histogram_bound(int k)
+{
+    return 1u << (HISTOGRAM_MIN_SHIFT + HISTOGRAM_STEP_SHIFT * k);
+}
+
+static inline void histogram_record(struct histogram *h, uint32_t us)
+{
+    int k = 0;
+
+    if (us > (1u << HISTOGRAM_MIN_SHIFT)) {
+        // Bits needed for us - 1, i.e. ceil(log2(us))
+        int bits = 32 - __builtin_clz(us - 1);
+        k = (bits - HISTOGRAM_MIN_SHIFT + HISTOGRAM_STEP_SHIFT - 1) / HISTOGRAM_STEP_SHIFT;
+    }
+    if (k >= HISTOGRAM_BUCKETS)
+        k = HISTOGRAM_BUCKETS - 1;
+    h->buckets[k]++;
+    h->count++;
+    h->sum_us += us;
+}
+
+#endif
@@ -1,14 +1,166 @@
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "mem.h"
+#include "user_interface.h"
+#include "espconn.h"
 #include "lwip/tcp.h"
+#ifndef HTTP_STACKLESS
 #include "cont.h"
+#include "contwait.h"
+#include "sha1.h"
+#endif
 
+#include "printf.h"
 #include "httpserver.h"
+#include "trace.h"
+#include "log.h"
 
 #define HTTP_MAX_LINE_SIZE 512
 
-#define HTTP_MAX_HANDLERS 5
+// Keep-alive connections idle for longer than this are closed. Should be
+// longer than the Prometheus scrape interval so scrapes reuse connections.
+#ifndef HTTP_KEEPALIVE_TIMEOUT_MS
+#define HTTP_KEEPALIVE_TIMEOUT_MS 20000
+#endif
+
+// Clients that take longer than this to send the request line, or the
+// headers after it, are dropped so they cannot hold on to a slot
+#ifndef HTTP_REQUEST_LINE_TIMEOUT_MS
+#define HTTP_REQUEST_LINE_TIMEOUT_MS 5000
+#endif
+#ifndef HTTP_HEADERS_TIMEOUT_MS
+#define HTTP_HEADERS_TIMEOUT_MS 5000
+#endif
+
+// Close the connection after this many requests
+#ifndef HTTP_KEEPALIVE_MAX_REQUESTS
+#define HTTP_KEEPALIVE_MAX_REQUESTS 100
+#endif
+
+// tcp_poll interval, in units of the 500ms TCP slow timer
+#define HTTP_POLL_INTERVAL 2
+
+// Received data queued per connection beyond what the reader consumed
+#ifndef HTTP_RECV_QUEUE_MAX
+#define HTTP_RECV_QUEUE_MAX TCP_WND
+#endif
+
+// Connections accepted while all slots are busy wait here, with their
+// received data held, until a slot frees up
+#ifndef HTTP_ACCEPT_QUEUE_MAX
+#define HTTP_ACCEPT_QUEUE_MAX 4
+#endif
+
+// Queued connections that do not get a slot within this time are dropped.
+// Connections idle between keep-alive requests are closed to make room
+// for them.
+#ifndef HTTP_QUEUE_TIMEOUT_MS
+#define HTTP_QUEUE_TIMEOUT_MS 5000
+#endif
+
+// Received data held and (stackless engine) copied response data queued,
+// across all connections. The per-connection limits alone would let every
+// slot hold a full window at once.
+#ifndef HTTP_QUEUE_BUDGET
+#define HTTP_QUEUE_BUDGET 8192
+#endif
+
+// Small writes are coalesced into full segments
+#define HTTP_OUT_BUF_SIZE TCP_MSS
+
+// Request body left unread by the handler is discarded before the next
+// request if it is at most this long, otherwise the connection is closed
+#ifndef HTTP_BODY_DRAIN_MAX
+#define HTTP_BODY_DRAIN_MAX 2048
+#endif
+
+// Clients that stall for longer than this while sending a request body
+// are dropped
+#ifndef HTTP_BODY_TIMEOUT_MS
+#define HTTP_BODY_TIMEOUT_MS 5000
+#endif
+
+// Clients that acknowledge none of our output for this long (e.g. by
+// advertising a zero window) are dropped, whatever the phase
+#ifndef HTTP_SEND_TIMEOUT_MS
+#define HTTP_SEND_TIMEOUT_MS 10000
+#endif
+
+// Longest If-None-Match value kept; longer lists are truncated
+#define HTTP_ETAG_SIZE 32
+
+// Chunked bodies are framed in the staging buffer: the chunk size goes in
+// space reserved in front of the data (always 4 hex digits, zero-padded)
+// and the trailing CRLF in space kept free at the end
+#define HTTP_CHUNK_HDR_SIZE 6
+#define HTTP_CHUNK_TRAILER_SIZE 2
+
+// Static RAM data shorter than this is staged like any other write, since a
+// separate segment would cost more than the copy
+#define HTTP_STATIC_MIN_SIZE 128
+
+// Stackless engine: parsed request fields. Longer paths get a 414, longer
+// tracked header values are truncated.
+#define HTTP_SM_METHOD_SIZE 8
+#define HTTP_SM_PATH_SIZE 96
+#define HTTP_SM_VERSION_SIZE 10
+#define HTTP_SM_NAME_SIZE 20
+#define HTTP_SM_VALUE_SIZE 32
+
+// Stackless engine: response data that does not fit in the send buffer is
+// queued on the heap up to this many bytes per connection
+#ifndef HTTP_SM_QUEUE_MAX
+#define HTTP_SM_QUEUE_MAX 4096
+#endif
+
+// WebSocket connections quiet for this long are pinged, and dropped if the
+// pong does not come back in time
+#ifndef HTTP_WS_PING_INTERVAL_MS
+#define HTTP_WS_PING_INTERVAL_MS 30000
+#endif
+#ifndef HTTP_WS_PONG_TIMEOUT_MS
+#define HTTP_WS_PONG_TIMEOUT_MS 10000
+#endif
+
+// Sec-WebSocket-Key is 16 bytes in base64
+#define HTTP_WS_KEY_SIZE 24
+#define HTTP_WS_CONTROL_MAX 125
+
+#define HTTP_WS_CONTINUATION 0
+#define HTTP_WS_CLOSE 8
+#define HTTP_WS_PING 9
+#define HTTP_WS_PONG 10
+
+#define HTTP_WS_CLOSE_NORMAL 1000
+#define HTTP_WS_CLOSE_PROTOCOL_ERROR 1002
+
+// Memory-mapped SPI flash (ICACHE_RODATA_ATTR), which only supports
+// aligned 32-bit loads and so cannot be handed to lwIP directly
+#define HTTP_FLASH_START 0x40200000
+#define HTTP_FLASH_END 0x40300000
+
+#ifdef HTTP_STACKLESS
+enum {
+    HTTP_SM_METHOD,
+    HTTP_SM_PATH,
+    HTTP_SM_VERSION,
+    HTTP_SM_HEADER_NAME,
+    HTTP_SM_HEADER_VALUE,
+    HTTP_SM_DONE,
+    HTTP_SM_ERROR,
+};
+
+// Output the send buffer could not take yet
+struct httpoutbuf {
+    struct httpoutbuf *next;
+    const uint8_t *data;
+    size_t len;
+    u8_t flags;
+    uint8_t buf[];
+};
+#endif
 
 struct httpconn {
     struct httpserver *hs;
@@ -19,17 +171,145 @@ struct httpconn {
     int eof;
     struct pbuf *recv_data;
     size_t recv_off;
+    size_t scan_len;
+    size_t recv_unacked;
 
+#ifdef HTTP_STACKLESS
+    uint8_t state;
+    uint8_t len;
+    uint8_t tracked;
+    uint8_t overflow;
+    char method[HTTP_SM_METHOD_SIZE];
+    char path[HTTP_SM_PATH_SIZE];
+    char version[HTTP_SM_VERSION_SIZE];
+    char name[HTTP_SM_NAME_SIZE];
+    char value[HTTP_SM_VALUE_SIZE];
+#else
     char request[HTTP_MAX_LINE_SIZE];
     int no_more_headers;
+#endif
+
+    int requests;
+    int keepalive;
+    // What the connection is waiting for, and since when
+    int phase;
+    uint32_t phase_since;
+    // Last time output was acknowledged, or first written after none was
+    // outstanding
+    uint32_t send_progress;
+#ifndef HTTP_STACKLESS
+    // The client is yielded in httpserver_send() waiting for buffer space
+    int send_waiting;
+#endif
+    // For the latency histograms; request_start is 0 until the first byte
+    // of the next request is in
+    uint32_t accepted_at;
+    uint32_t request_start;
+    uint32_t handler_start;
+    int content_length;
+    int in_body;
+    size_t body_sent;
+    int http11;
+    int method_id;
+    int accept_gzip;
+    // Request body bytes not read yet, and whether the body is chunked
+    // (which is not supported)
+    int body_left;
+    int body_chunked;
+    // Response has headers only (304)
+    int no_body;
+    // Conditional request headers
+    char if_none_match[HTTP_ETAG_SIZE];
+    uint32_t if_modified_since;
+    // Validators sent with the response headers
+    const char *etag;
+    uint32_t last_modified;
+    // Event stream subscriber: requested by the handler, then streaming
+    // once the response headers are out. Broadcasts are dropped while
+    // congested, until everything sent before has been acknowledged.
+    int subscriber;
+    int congested;
+    // Body is sent with chunked encoding; chunk_open means a chunk header
+    // is reserved at chunk_start in the staging buffer
+    int chunked;
+    int chunk_open;
+    size_t chunk_start;
+
+#ifndef HTTP_STACKLESS
+    // WebSocket handshake headers
+    int upgrade;
+    int connection_upgrade;
+    int ws_version;
+    char ws_key[HTTP_WS_KEY_SIZE + 1];
+    // Upgraded to a WebSocket. ws_closed is set once our close frame is
+    // out, ws_woken by httpserver_ws_wake_all().
+    int websocket;
+    int ws_closed;
+    int ws_woken;
+    uint32_t ws_last_rx;
+    int ws_ping_pending;
+    uint32_t ws_ping_since;
+#endif
+
+#ifdef HTTP_STACKLESS
+    // The last response ended the connection; close once its output is
+    // out. Kept apart from keepalive, which the parser already sets for
+    // any pipelined request after it.
+    int closing;
+    // Body writer still to be resumed from the sent callback
+    http_writer_t writer;
+    uint32_t writer_step;
+    // Allocated while a response is being written
+    char *out;
+    struct httpoutbuf *out_queue;
+    size_t out_queued;
+#else
+    char out[HTTP_OUT_BUF_SIZE];
+#endif
+    size_t out_len;
+    int write_failed;
 
+#ifndef HTTP_STACKLESS
     cont_t cont;
+    contwait_t wait;
+    // Deepest stack use seen in this slot, kept across connections
+    uint32_t stack_max;
+#endif
     int exited;
 };
 
-struct httphandler {
-    const char *path;
-    http_handler_t func;
+// Route index entry: routes are found by hashing the path (or, for prefix
+// routes, the part before the '*') and probing linearly
+struct httproute_slot {
+    uint32_t hash;
+    // Index into the route table plus one, 0 if the slot is empty
+    uint16_t route;
+    uint8_t prefix;
+};
+
+enum {
+    HTTP_SUBSCRIBER_NONE = 0,
+    HTTP_SUBSCRIBER_PENDING,
+    HTTP_SUBSCRIBER_STREAMING,
+};
+
+enum {
+    HTTP_PHASE_REQUEST_LINE = 0,
+    HTTP_PHASE_HEADERS,
+    HTTP_PHASE_IDLE,
+    HTTP_PHASE_BODY,
+    // Handling the request or sending the response; only the send
+    // timeout applies
+    HTTP_PHASE_BUSY,
+};
+
+struct httppending {
+    httpserver_t *hs;
+    // NULL if this entry is free
+    struct tcp_pcb *tcpb;
+    struct pbuf *recv_data;
+    int eof;
+    uint32_t since;
 };
 
 struct httpserver {
@@ -37,327 +317,2773 @@ struct httpserver {
     int port;
     int maxconns;
     httpconn_t *conns;
-    int handler_count;
-    struct httphandler handlers[HTTP_MAX_HANDLERS];
+    const struct httproute *routes;
+    int route_count;
+    struct httproute_slot *route_index;
+    uint32_t route_mask;
+    // Requests per entry of routes
+    uint32_t *route_requests;
+    struct httppending pending[HTTP_ACCEPT_QUEUE_MAX];
+    // Bytes counted against HTTP_QUEUE_BUDGET
+    size_t queued_bytes;
+    struct httpserver_stats stats;
 };
 
 ICACHE_FLASH_ATTR
-static void httpserver_handle_client(void *arg);
+static void httpserver_accept_pending(httpserver_t *hs);
+
+// Window updates are batched until this many bytes have been consumed, or
+// until the reader is about to wait for more data
+#define HTTP_RECVED_BATCH TCP_MSS
+
+// Headers the server looks at itself; others are skipped without copying
+// them out of the pbufs unless a handler asks for them
+static const char *const httpserver_tracked_headers[] = {
+    "Connection",
+    "Accept-Encoding",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Content-Length",
+    "Transfer-Encoding",
+#ifndef HTTP_STACKLESS
+    "Upgrade",
+    "Sec-WebSocket-Key",
+    "Sec-WebSocket-Version",
+#endif
+    NULL
+};
 
 ICACHE_FLASH_ATTR
-static void httpserver_run_client(httpconn_t *conn)
+static int httpserver_strcaseeq(const char *a, const char *b)
 {
-//     os_printf("cont_run %08x\n", (uint32_t)conn);
-    if (conn->exited) {
-        os_printf("refusing to run dead connection %08x!\n", (uint32_t)conn);
-        return;
+    while (*a && *b) {
+        char ca = *a++, cb = *b++;
+        if (ca >= 'A' && ca <= 'Z')
+            ca += 'a' - 'A';
+        if (cb >= 'A' && cb <= 'Z')
+            cb += 'a' - 'A';
+        if (ca != cb)
+            return 0;
     }
-    cont_run(&conn->cont, httpserver_handle_client, conn);
-//     os_printf("cont_run returned\n");
+    return *a == *b;
 }
 
+// Whether a comma separated header value contains token, case-insensitively
 ICACHE_FLASH_ATTR
-static int httpserver_readline(httpconn_t *conn, char *buf, size_t size)
+static int httpserver_has_token(const char *list, const char *token)
 {
-    char *p = buf;
-    char *end = p + size - 1;
-    while (p < end)
-    {
-        while (!conn->recv_data && !conn->eof) {
-//             os_printf("yield (read)\n");
-            cont_yield(&conn->cont);
-//             os_printf("yield ret\n");
-        }
-        if (conn->eof) {
-            break;
-        }
-        size_t l = pbuf_copy_partial(conn->recv_data, p, end - p, conn->recv_off);
-//         os_printf("copied %d/%d bytes @%d\n", l, conn->recv_data->tot_len, conn->recv_off);
-        for (int i = 0; i < l; i++) {
-            if (p[i] == '\n') {
-                p[i] = '\0';
-                if ((i > 0 || p > buf) && p[i - 1] == '\r')
-                    p[i - 1] = '\0';
-                conn->recv_off += i + 1;
-//                 os_printf("recved: %d\n", i);
-                tcp_recved(conn->tcpb, i + 1);
-                if (conn->recv_off >= conn->recv_data->tot_len) {
-                    pbuf_free(conn->recv_data);
-                    conn->recv_data = NULL;
-                    conn->recv_off = 0;
-                }
-                return p - buf;
+    size_t len = strlen(token);
+
+    while (*list) {
+        while (*list == ' ' || *list == '\t' || *list == ',')
+            list++;
+        size_t n = 0;
+        while (list[n] && list[n] != ',')
+            n++;
+        size_t end = n;
+        while (end && (list[end - 1] == ' ' || list[end - 1] == '\t'))
+            end--;
+        if (end == len) {
+            size_t i;
+            for (i = 0; i < len; i++) {
+                char c = list[i];
+                if (c >= 'A' && c <= 'Z')
+                    c += 'a' - 'A';
+                if (c != token[i])
+                    break;
             }
+            if (i == len)
+                return 1;
         }
-        conn->recv_off += l;
-//         os_printf("recved: %d\n", l);
-        tcp_recved(conn->tcpb, l);
-        p += l;
-        if (conn->recv_off >= conn->recv_data->tot_len) {
-            pbuf_free(conn->recv_data);
-            conn->recv_data = NULL;
-            conn->recv_off = 0;
-        }
+        list += n;
     }
-    p[0] = '\0';
-    return p - buf + 1;
+    return 0;
 }
 
 ICACHE_FLASH_ATTR
-int httpserver_write_data(httpconn_t *conn, const void *data, size_t length)
+static int httpserver_is_tracked(const char *name)
 {
-    err_t ret;
-    const uint8_t *p = data;
-
-    while (length) {
-        size_t block = length;
-        size_t sendq = tcp_sndbuf(conn->tcpb);
-        if (block > sendq)
-            block = sendq;
-//         os_printf("tcp_write: '%s'\n", p);
-        ret = tcp_write(conn->tcpb, p, length, TCP_WRITE_FLAG_COPY);
-        if (ret == ERR_MEM) {
-            tcp_output(conn->tcpb);
-//             os_printf("yield (write)\n");
-            cont_yield(&conn->cont);
-            continue;
-        } else if (ret != ERR_OK) {
-            os_printf("tcp_write failed: %d\n", ret);
-            return p - (const uint8_t*)data;
-        }
-        length -= block;
-        p += block;
+    for (int i = 0; httpserver_tracked_headers[i]; i++) {
+        if (httpserver_strcaseeq(name, httpserver_tracked_headers[i]))
+            return 1;
     }
-    return p - (const uint8_t*)data;
+    return 0;
 }
 
+static const char httpserver_months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+// Days since 1970-01-01 for a date in the proleptic Gregorian calendar
 ICACHE_FLASH_ATTR
-int httpserver_write_string(httpconn_t *conn, const char *data)
+static int32_t httpserver_days_from_civil(int y, int m, int d)
 {
-    return httpserver_write_data(conn, data, strlen(data));
+    y -= m <= 2;
+    int era = y / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
 }
 
+// Parse an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"). Returns the Unix
+// time, or 0 for anything else (the obsolete formats are not supported).
 ICACHE_FLASH_ATTR
-int httpserver_read_header(httpconn_t *conn, char **header, char **value)
+static uint32_t httpserver_parse_date(const char *s)
 {
-    if (conn->no_more_headers)
-        return 0;
+    int mon;
 
-    httpserver_readline(conn, conn->request, sizeof(conn->request));
+    if (strlen(s) < 29 || s[3] != ',' || s[7] != ' ' || s[11] != ' ' ||
+        s[16] != ' ' || s[19] != ':' || s[22] != ':')
+        return 0;
+    for (mon = 0; mon < 12; mon++) {
+        if (!memcmp(s + 8, httpserver_months + 3 * mon, 3))
+            break;
+    }
+    if (mon == 12)
+        return 0;
 
-    if (!conn->request[0]) {
-        conn->no_more_headers = 1;
+    int32_t days = httpserver_days_from_civil(atoi(s + 12), mon + 1, atoi(s + 5));
+    if (days < 0)
         return 0;
+    return days * 86400 + atoi(s + 17) * 3600 + atoi(s + 20) * 60 + atoi(s + 23);
+}
+
+// Format t as an IMF-fixdate, buf must hold 30 bytes
+ICACHE_FLASH_ATTR
+static void httpserver_format_date(char *buf, uint32_t t)
+{
+    static const char wdays[] = "ThuFriSatSunMonTueWed";
+    uint32_t days = t / 86400;
+    uint32_t secs = t % 86400;
+
+    // Inverse of httpserver_days_from_civil
+    int32_t z = days + 719468;
+    int era = z / 146097;
+    int doe = z - era * 146097;
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    int d = doy - (153 * mp + 2) / 5 + 1;
+    int m = mp < 10 ? mp + 3 : mp - 9;
+    int y = yoe + era * 400 + (m <= 2);
+
+    memcpy(buf, wdays + 3 * (days % 7), 3);
+    os_sprintf(buf + 3, ", %02d     %04d %02d:%02d:%02d GMT",
+               d, y, secs / 3600, secs / 60 % 60, secs % 60);
+    memcpy(buf + 8, httpserver_months + 3 * (m - 1), 3);
+}
+
+// Update connection state from a request header
+ICACHE_FLASH_ATTR
+static void httpserver_process_header(httpconn_t *conn, const char *name, const char *value)
+{
+    if (httpserver_strcaseeq(name, "Connection")) {
+        if (httpserver_strcaseeq(value, "close"))
+            conn->keepalive = 0;
+        else if (httpserver_strcaseeq(value, "keep-alive"))
+            conn->keepalive = 1;
+#ifndef HTTP_STACKLESS
+        conn->connection_upgrade = httpserver_has_token(value, "upgrade");
+#endif
+    } else if (httpserver_strcaseeq(name, "Accept-Encoding")) {
+        conn->accept_gzip = strstr(value, "gzip") != NULL;
+    } else if (httpserver_strcaseeq(name, "If-None-Match")) {
+        strncpy(conn->if_none_match, value, sizeof(conn->if_none_match) - 1);
+        conn->if_none_match[sizeof(conn->if_none_match) - 1] = '\0';
+    } else if (httpserver_strcaseeq(name, "If-Modified-Since")) {
+        conn->if_modified_since = httpserver_parse_date(value);
+    } else if (httpserver_strcaseeq(name, "Content-Length")) {
+        conn->body_left = atoi(value);
+        if (conn->body_left < 0)
+            conn->body_left = 0;
+    } else if (httpserver_strcaseeq(name, "Transfer-Encoding")) {
+        conn->body_chunked = !httpserver_strcaseeq(value, "identity");
+#ifndef HTTP_STACKLESS
+    } else if (httpserver_strcaseeq(name, "Upgrade")) {
+        conn->upgrade = httpserver_has_token(value, "websocket");
+    } else if (httpserver_strcaseeq(name, "Sec-WebSocket-Key")) {
+        // Anything but the expected length is invalid, not truncated
+        if (strlen(value) == HTTP_WS_KEY_SIZE)
+            strcpy(conn->ws_key, value);
+    } else if (httpserver_strcaseeq(name, "Sec-WebSocket-Version")) {
+        conn->ws_version = atoi(value);
+#endif
     }
+}
 
-    char *phdr = conn->request;
-    char *pval = strchr(phdr, ':');
+ICACHE_FLASH_ATTR
+static int httpserver_slot(httpconn_t *conn)
+{
+    return conn - conn->hs->conns;
+}
 
-    if (pval) {
-        *pval++ = '\0';
-        if (*pval == ' ')
-            *pval++ = '\0';
+ICACHE_FLASH_ATTR
+static void httpserver_ack(httpconn_t *conn)
+{
+    if (conn->recv_unacked) {
+//         os_printf("recved: %d\n", conn->recv_unacked);
+        trace(TRACE_RECVED, httpserver_slot(conn), conn->recv_unacked, 0);
+        tcp_recved(conn->tcpb, conn->recv_unacked);
+        conn->recv_unacked = 0;
     }
+}
 
-    if (header)
-        *header = phdr;
-    if (value)
-        *value = pval;
+// Drop len bytes from the front of the receive queue, freeing pbufs as
+// they are fully consumed
+ICACHE_FLASH_ATTR
+static void httpserver_consume(httpconn_t *conn, size_t len)
+{
+    conn->recv_off += len;
+    conn->scan_len = conn->scan_len > len ? conn->scan_len - len : 0;
+    conn->recv_unacked += len;
+    if (conn->recv_unacked >= HTTP_RECVED_BATCH)
+        httpserver_ack(conn);
 
-//     os_printf("HDR: %s='%s'\n", phdr, pval);
-    return 1;
+    while (conn->recv_data && conn->recv_off >= conn->recv_data->len) {
+        struct pbuf *head = conn->recv_data;
+        struct pbuf *next = head->next;
+
+        conn->recv_off -= head->len;
+        conn->hs->queued_bytes -= head->len;
+        // Keep the rest of the chain alive while freeing the head
+        if (next)
+            pbuf_ref(next);
+        pbuf_free(head);
+        conn->recv_data = next;
+    }
 }
 
 ICACHE_FLASH_ATTR
-int httpserver_end_request(httpconn_t *conn)
+static void httpserver_set_phase(httpconn_t *conn, int phase)
 {
-    while (httpserver_read_header(conn, NULL, NULL));
-    return 0;
+    conn->phase = phase;
+    conn->phase_since = system_get_time();
 }
 
 ICACHE_FLASH_ATTR
-int httpserver_start_response(httpconn_t *conn, int code, const char *text)
+static void httpserver_record_close(httpconn_t *conn)
 {
-    char buf[32];
-    os_sprintf(buf, "HTTP/1.1 %d ", code);
-    httpserver_write_string(conn, buf);
-    httpserver_write_string(conn, text);
-    httpserver_write_string(conn, "\r\nConnection: close\r\n");
-    return 0;
+    histogram_record(&conn->hs->stats.connection_us, system_get_time() - conn->accepted_at);
 }
 
 ICACHE_FLASH_ATTR
-int httpserver_send_header(httpconn_t *conn, const char *header, const char *value)
+static void httpserver_free_recv(httpconn_t *conn)
 {
-    httpserver_write_string(conn, header);
-    httpserver_write_string(conn, ": ");
-    httpserver_write_string(conn, value);
-    httpserver_write_string(conn, "\r\n");
-    return 0;
+    if (conn->recv_data) {
+        conn->hs->queued_bytes -= conn->recv_data->tot_len;
+        pbuf_free(conn->recv_data);
+    }
+    conn->recv_data = NULL;
+    conn->recv_off = 0;
+    conn->scan_len = 0;
 }
 
 ICACHE_FLASH_ATTR
-int httpserver_end_headers(httpconn_t *conn)
+static void httpserver_copy_out(httpconn_t *conn, char *buf, size_t len)
 {
-    httpserver_write_string(conn, "\r\n");
+    struct pbuf *q = conn->recv_data;
+    size_t off = conn->recv_off;
+
+    conn->hs->stats.recv_copied += len;
+    while (len) {
+        size_t block = q->len - off;
+        if (block > len)
+            block = len;
+        memcpy(buf, (const uint8_t *)q->payload + off, block);
+        buf += block;
+        len -= block;
+        off = 0;
+        q = q->next;
+    }
 }
 
 ICACHE_FLASH_ATTR
-void httpserver_handle_404(httpconn_t *conn, const char *path, char *query_string)
+static size_t httpserver_queued(httpconn_t *conn)
 {
-    httpserver_end_request(conn);
-    httpserver_start_response(conn, 404, "Not Found");
-    httpserver_send_header(conn, "Content-Type", "text/plain");
-    httpserver_end_headers(conn);
-    httpserver_write_string(conn, "No handler at specified URL");
+    return conn->recv_data ? conn->recv_data->tot_len - conn->recv_off : 0;
 }
 
+// Whether output is waiting for the client: unacknowledged in lwIP, or
+// still held by us for lack of send buffer space
 ICACHE_FLASH_ATTR
-static void httpserver_handle_client(void *arg)
+static int httpserver_send_pending(httpconn_t *conn)
 {
-    httpconn_t *conn = arg;
-//     os_printf("httpserver_handle_client %08x\n", (uint32_t)arg);
+#ifdef HTTP_STACKLESS
+    if (conn->out_queue)
+        return 1;
+#else
+    if (conn->send_waiting)
+        return 1;
+#endif
+    return tcp_sndqueuelen(conn->tcpb) != 0;
+}
 
-    httpserver_readline(conn, conn->request, sizeof(conn->request));
-    os_printf("> %s\n", conn->request);
+// Whether the client may still be sending a request body we gave up on
+// while it does not have the whole response yet. Closing with unread data
+// resets the connection, which can throw the response away.
+ICACHE_FLASH_ATTR
+static int httpserver_must_linger(httpconn_t *conn)
+{
+    if (conn->eof || conn->write_failed)
+        return 0;
+    return (conn->body_left || conn->body_chunked) && httpserver_send_pending(conn);
+}
 
-    char *method = strtok(conn->request, " ");
-    char *path = strtok(NULL, " ");
-    char *version = strtok(NULL, " ");
+// Drop everything queued and open the window for it again before a close
+ICACHE_FLASH_ATTR
+static void httpserver_discard(httpconn_t *conn)
+{
+    httpserver_consume(conn, httpserver_queued(conn));
+    httpserver_ack(conn);
+    httpserver_free_recv(conn);
+}
 
-    if (!method || !path || !version || !*method || !*path || !*version)
-        goto cleanup;
+#ifndef HTTP_STACKLESS
 
-//     os_printf("method: '%s' path: '%s' version: '%s'\n", method, path, version);
+ICACHE_FLASH_ATTR
+static void httpserver_handle_client(void *arg);
 
-    if (strcmp(method, "GET")) {
-        // POST not supported yet
-        httpserver_end_request(conn);
-        httpserver_start_response(conn, 405, "Method Not Allowed");
-        httpserver_end_headers(conn);
-        goto cleanup;
+ICACHE_FLASH_ATTR
+static void httpserver_run_client(httpconn_t *conn)
+{
+//     os_printf("cont_run %08x\n", (uint32_t)conn);
+    if (conn->exited) {
+        LOG_ERROR("refusing to run dead connection %08x!\n", (uint32_t)conn);
+        return;
     }
+    trace(TRACE_RUN, httpserver_slot(conn), 0, 0);
+    contwait_run(&conn->wait, httpserver_handle_client, conn);
+    trace(TRACE_RUN_END, httpserver_slot(conn), 0, 0);
+//     os_printf("cont_run returned\n");
+    if (!conn->used)
+        httpserver_accept_pending(conn->hs);
+}
 
-    char *qs = strchr(path, '?');
-    if (qs) {
-        *qs++ = '\0';
-    }
+ICACHE_FLASH_ATTR
+static void httpserver_wake(void *arg)
+{
+    httpserver_run_client(arg);
+}
 
-//     os_printf("path: '%s' query: '%s'\n", path, qs);
+ICACHE_FLASH_ATTR
+static void httpserver_note_stack(httpconn_t *conn)
+{
+    uint32_t used = CONT_STACKSIZE - cont_get_free_stack(&conn->cont);
 
-    httpserver_t *hs = conn->hs;
+    if (used > conn->stack_max)
+        conn->stack_max = used;
+}
 
-    for (int i = 0; i < hs->handler_count; i++) {
-        if (!strcmp(path, hs->handlers[i].path)) {
-            hs->handlers[i].func(conn, path, qs);
-            goto cleanup;
-        }
-    }
+typedef uint32_t __attribute__((__may_alias__)) http_word_t;
 
-    httpserver_handle_404(conn, path, qs);
+// Find the first '\n' in len bytes at p, a word at a time once aligned.
+// Returns its index, or -1.
+ICACHE_FLASH_ATTR
+static int httpserver_find_nl(const uint8_t *p, size_t len)
+{
+    const uint8_t *s = p;
+    const uint8_t *end = p + len;
 
-cleanup:
-    tcp_output(conn->tcpb);
-    conn->exited = 1;
-    conn->used = 0;
-    if (tcp_close(conn->tcpb) == ERR_OK) {
-        conn->used = 0;
-    } else {
-        os_printf("tcp_close failed\n");
+    while (s < end && ((uint32_t)s & 3)) {
+        if (*s == '\n')
+            return s - p;
+        s++;
     }
-    tcp_arg(conn->tcpb, NULL);
-//     os_printf("httpserver_handle_client returning\n");
+    while (s + 4 <= end) {
+        uint32_t w = *(const http_word_t *)s ^ 0x0a0a0a0a;
+        // Nonzero iff some byte of w is zero
+        if ((w - 0x01010101) & ~w & 0x80808080)
+            break;
+        s += 4;
+    }
+    while (s < end) {
+        if (*s == '\n')
+            return s - p;
+        s++;
+    }
+    return -1;
 }
 
+// Look for the end of the line at the head of the receive queue, resuming
+// where the previous scan stopped. Returns the line length including the
+// '\n', or 0 if it has not been received yet.
 ICACHE_FLASH_ATTR
-static err_t httpserver_recv(void *arg, struct tcp_pcb *tcpb, struct pbuf *p, err_t err)
+static size_t httpserver_scan_line(httpconn_t *conn)
 {
-    httpconn_t *conn = arg;
-//     os_printf("httpserver_recv %08x\n", (uint32_t)conn);
-    if (!conn) {
-        if (p || err != ERR_OK)
-            os_printf("zombie httpserver_recv: %p, %d\n", p, err);
-        return ERR_OK;
+    struct pbuf *q = conn->recv_data;
+    size_t off = conn->recv_off + conn->scan_len;
+    size_t pos = conn->scan_len;
+
+    while (q && off >= q->len) {
+        off -= q->len;
+        q = q->next;
     }
-    if (!p) {
-        conn->eof = 1;
-        httpserver_run_client(conn);
-        return ERR_OK;
+    while (q) {
+        int i = httpserver_find_nl((const uint8_t *)q->payload + off, q->len - off);
+        if (i >= 0) {
+            conn->scan_len = 0;
+            return pos + i + 1;
+        }
+        pos += q->len - off;
+        off = 0;
+        q = q->next;
     }
-    if (conn->recv_data) {
-        os_printf("httpserver_recv queue busy, refusing data\n");
-        return ERR_MEM;
+    conn->scan_len = pos;
+    return 0;
+}
+
+// Compare the start of the queued line against "name:", case-insensitively
+ICACHE_FLASH_ATTR
+static int httpserver_peek_header(httpconn_t *conn, const char *name)
+{
+    struct pbuf *q = conn->recv_data;
+    size_t off = conn->recv_off;
+
+    for (;;) {
+        while (q && off >= q->len) {
+            off -= q->len;
+            q = q->next;
+        }
+        if (!q)
+            return 0;
+
+        char c = ((const char *)q->payload)[off++];
+        if (!*name)
+            return c == ':';
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        char n = *name++;
+        if (n >= 'A' && n <= 'Z')
+            n += 'a' - 'A';
+        if (c != n)
+            return 0;
     }
-    conn->recv_data = p;
-    httpserver_run_client(conn);
-    return ERR_OK;
 }
 
 ICACHE_FLASH_ATTR
-static err_t httpserver_sent(void *arg, struct tcp_pcb *tcpb, u16_t len)
+static void httpserver_wait_data(httpconn_t *conn)
 {
-    httpconn_t *conn = arg;
-    if (!conn)
-        return ERR_OK;
-    os_printf("httpserver_sent %08x\n", (uint32_t)conn);
-    httpserver_run_client(conn);
-    return ERR_OK;
+    // The peer may be blocked on a closed window
+    httpserver_ack(conn);
+    conn->hs->stats.yields++;
+    trace(TRACE_YIELD_READ, httpserver_slot(conn), httpserver_queued(conn), 0);
+//     os_printf("yield (read)\n");
+    cont_yield(&conn->cont);
+//     os_printf("yield ret\n");
 }
 
+// Wait until a whole line is queued, the peer closed the connection, or
+// more than max bytes are queued without a line end. Returns the number
+// of bytes of the line that are available, including the '\n'.
 ICACHE_FLASH_ATTR
-static void httpserver_err(void *arg, err_t err)
+static size_t httpserver_wait_line(httpconn_t *conn, size_t max)
 {
-    httpconn_t *conn = arg;
-    os_printf("httpserver_err: error %d\n", err);
-    if (conn) {
-        conn->exited = 1;
-        conn->used = 0;
+    size_t len;
+
+    while (!(len = httpserver_scan_line(conn))) {
+        if (conn->eof || conn->scan_len >= max)
+            return conn->scan_len;
+        httpserver_wait_data(conn);
     }
+    return len;
 }
 
 ICACHE_FLASH_ATTR
-static err_t httpserver_accept(void *arg, struct tcp_pcb *tcpb, err_t err)
+static void httpserver_skip_line(httpconn_t *conn)
 {
-    httpserver_t *hs = arg;
-    httpconn_t *conn = NULL;
-
-//     os_printf("accept\n");
+    size_t len;
 
-    for (int i = 0; i < hs->maxconns; i++) {
-        if (!hs->conns[i].used) {
-            conn = &hs->conns[i];
-            break;
-        }
+    while (!(len = httpserver_scan_line(conn))) {
+        // Nothing in the queue is needed anymore
+        httpserver_consume(conn, conn->scan_len);
+        if (conn->eof)
+            return;
+        httpserver_wait_data(conn);
     }
+    httpserver_consume(conn, len);
+}
 
-    if (!conn) {
-        os_printf("httpserver: too many connections\n");
-        return ERR_MEM;
+// Read a line into buf, without the line terminator. Lines longer than the
+// buffer are truncated and the rest is discarded.
+ICACHE_FLASH_ATTR
+static int httpserver_readline(httpconn_t *conn, char *buf, size_t size)
+{
+    size_t len = httpserver_wait_line(conn, size - 1);
+    size_t n = len < size - 1 ? len : size - 1;
+
+    httpserver_copy_out(conn, buf, n);
+    httpserver_consume(conn, n);
+
+    if (n && buf[n - 1] == '\n') {
+        n--;
+        if (n && buf[n - 1] == '\r')
+            n--;
+    } else if (n == size - 1) {
+        httpserver_skip_line(conn);
     }
+    buf[n] = '\0';
+    return n;
+}
 
-    memset(conn, 0, sizeof(*conn));
-    conn->used = 1;
-    conn->hs = hs;
-    conn->tcpb = tcpb;
+#define httpserver_out_alloc(conn) 1
+
+ICACHE_FLASH_ATTR
+static int httpserver_send(httpconn_t *conn, const void *data, size_t length, u8_t flags)
+{
+    err_t ret;
+    const uint8_t *p = data;
+
+    if (conn->write_failed)
+        return -1;
+    if (!httpserver_send_pending(conn))
+        conn->send_progress = system_get_time();
+
+    while (length) {
+        size_t block = length;
+        size_t sendq = tcp_sndbuf(conn->tcpb);
+        if (block > sendq)
+            block = sendq;
+//         os_printf("tcp_write: '%s'\n", p);
+        ret = block ? tcp_write(conn->tcpb, p, block, flags) : ERR_MEM;
+        trace(TRACE_WRITE, httpserver_slot(conn), block, ret);
+        if (ret == ERR_MEM) {
+            // Wait for ACKs to free up send buffer space
+            conn->hs->stats.write_retries++;
+            conn->hs->stats.yields++;
+            trace(TRACE_YIELD_WRITE, httpserver_slot(conn), length, sendq);
+            tcp_output(conn->tcpb);
+//             os_printf("yield (write)\n");
+            conn->send_waiting = 1;
+            cont_yield(&conn->cont);
+            conn->send_waiting = 0;
+            continue;
+        } else if (ret != ERR_OK) {
+            LOG_ERROR("tcp_write failed: %d\n", ret);
+            conn->write_failed = 1;
+            return -1;
+        }
+        conn->hs->stats.writes++;
+        conn->hs->stats.bytes_out += block;
+        length -= block;
+        p += block;
+    }
+    return 0;
+}
+
+#else /* HTTP_STACKLESS */
+
+ICACHE_FLASH_ATTR
+static int httpserver_out_alloc(httpconn_t *conn)
+{
+    if (!conn->out) {
+        conn->out = os_malloc(HTTP_OUT_BUF_SIZE);
+        if (!conn->out) {
+            LOG_ERROR("httpserver: out of memory for response\n");
+            conn->write_failed = 1;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Write as much as the send buffer takes and queue the rest, to be sent
+// from the sent callback. Copied data is duplicated into the queue, other
+// data is referenced.
+ICACHE_FLASH_ATTR
+static int httpserver_send(httpconn_t *conn, const void *data, size_t length, u8_t flags)
+{
+    err_t ret;
+    const uint8_t *p = data;
+
+    if (conn->write_failed)
+        return -1;
+    if (!httpserver_send_pending(conn))
+        conn->send_progress = system_get_time();
+
+    // Only write directly if nothing is queued ahead of us
+    if (!conn->out_queue) {
+        size_t block = length;
+        size_t sendq = tcp_sndbuf(conn->tcpb);
+        if (block > sendq)
+            block = sendq;
+        ret = block ? tcp_write(conn->tcpb, p, block, flags) : ERR_MEM;
+        trace(TRACE_WRITE, httpserver_slot(conn), block, ret);
+        if (ret == ERR_OK) {
+            conn->hs->stats.writes++;
+            conn->hs->stats.bytes_out += block;
+            length -= block;
+            p += block;
+        } else if (ret == ERR_MEM) {
+            conn->hs->stats.write_retries++;
+        } else {
+            LOG_ERROR("tcp_write failed: %d\n", ret);
+            conn->write_failed = 1;
+            return -1;
+        }
+    }
+    if (!length)
+        return 0;
+
+    size_t copied = (flags & TCP_WRITE_FLAG_COPY) ? length : 0;
+    if (conn->out_queued + length > HTTP_SM_QUEUE_MAX ||
+        conn->hs->queued_bytes + copied > HTTP_QUEUE_BUDGET) {
+        LOG_WARN("httpserver: send queue full\n");
+        conn->write_failed = 1;
+        return -1;
+    }
+
+    struct httpoutbuf *b = os_malloc(sizeof(*b) + copied);
+    if (!b) {
+        LOG_ERROR("httpserver: out of memory for send queue\n");
+        conn->write_failed = 1;
+        return -1;
+    }
+    b->next = NULL;
+    b->len = length;
+    b->flags = flags;
+    if (flags & TCP_WRITE_FLAG_COPY) {
+        memcpy(b->buf, p, length);
+        b->data = b->buf;
+    } else {
+        b->data = p;
+    }
+
+    struct httpoutbuf **tail = &conn->out_queue;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = b;
+    conn->out_queued += length;
+    conn->hs->queued_bytes += copied;
+    return 0;
+}
+
+// Push queued output into the send buffer
+ICACHE_FLASH_ATTR
+static void httpserver_drain(httpconn_t *conn)
+{
+    err_t ret;
+
+    while (conn->out_queue && !conn->write_failed) {
+        struct httpoutbuf *b = conn->out_queue;
+        size_t block = b->len;
+        size_t sendq = tcp_sndbuf(conn->tcpb);
+        if (block > sendq)
+            block = sendq;
+        if (!block)
+            break;
+        ret = tcp_write(conn->tcpb, b->data, block, b->flags);
+        trace(TRACE_WRITE, httpserver_slot(conn), block, ret);
+        if (ret == ERR_MEM) {
+            conn->hs->stats.write_retries++;
+            break;
+        } else if (ret != ERR_OK) {
+            LOG_ERROR("tcp_write failed: %d\n", ret);
+            conn->write_failed = 1;
+            break;
+        }
+        conn->hs->stats.writes++;
+        conn->hs->stats.bytes_out += block;
+        b->data += block;
+        b->len -= block;
+        conn->out_queued -= block;
+        if (b->flags & TCP_WRITE_FLAG_COPY)
+            conn->hs->queued_bytes -= block;
+        if (!b->len) {
+            conn->out_queue = b->next;
+            os_free(b);
+        }
+    }
+    tcp_output(conn->tcpb);
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_free_out(httpconn_t *conn)
+{
+    while (conn->out_queue) {
+        struct httpoutbuf *b = conn->out_queue;
+        conn->out_queue = b->next;
+        if (b->flags & TCP_WRITE_FLAG_COPY)
+            conn->hs->queued_bytes -= b->len;
+        os_free(b);
+    }
+    conn->out_queued = 0;
+    if (conn->out)
+        os_free(conn->out);
+    conn->out = NULL;
+    conn->out_len = 0;
+}
+
+#endif /* HTTP_STACKLESS */
+
+ICACHE_FLASH_ATTR
+static void httpserver_put_chunk_hdr(char *buf, size_t length)
+{
+    for (int i = 3; i >= 0; i--) {
+        buf[i] = "0123456789abcdef"[length & 0xf];
+        length >>= 4;
+    }
+    buf[4] = '\r';
+    buf[5] = '\n';
+}
+
+// Bytes of the staging buffer usable for data
+ICACHE_FLASH_ATTR
+static size_t httpserver_out_limit(httpconn_t *conn)
+{
+    return HTTP_OUT_BUF_SIZE - (conn->chunked ? HTTP_CHUNK_TRAILER_SIZE : 0);
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_flush(httpconn_t *conn)
+{
+    int ret;
+
+    if (conn->chunk_open) {
+        size_t length = conn->out_len - conn->chunk_start - HTTP_CHUNK_HDR_SIZE;
+
+        conn->chunk_open = 0;
+        if (length) {
+            httpserver_put_chunk_hdr(conn->out + conn->chunk_start, length);
+            conn->out[conn->out_len++] = '\r';
+            conn->out[conn->out_len++] = '\n';
+        } else {
+            // An empty chunk would end the body
+            conn->out_len = conn->chunk_start;
+        }
+    }
+
+    if (!conn->out_len)
+        return 0;
+
+    ret = httpserver_send(conn, conn->out, conn->out_len, TCP_WRITE_FLAG_COPY);
+    conn->out_len = 0;
+    return ret;
+}
+
+// Make sure the staging buffer exists and, for chunked bodies, that a chunk
+// header is reserved in it
+ICACHE_FLASH_ATTR
+static int httpserver_out_reserve(httpconn_t *conn)
+{
+    if (!httpserver_out_alloc(conn))
+        return 0;
+    if (conn->chunked && !conn->chunk_open) {
+        if (conn->out_len + HTTP_CHUNK_HDR_SIZE >= httpserver_out_limit(conn))
+            httpserver_flush(conn);
+        conn->chunk_start = conn->out_len;
+        conn->out_len += HTTP_CHUNK_HDR_SIZE;
+        conn->chunk_open = 1;
+    }
+    return 1;
+}
+
+// Send data as a chunk of its own, framed by two small copied writes
+ICACHE_FLASH_ATTR
+static int httpserver_send_chunk(httpconn_t *conn, const void *data, size_t length, u8_t flags)
+{
+    char hdr[HTTP_CHUNK_HDR_SIZE];
+
+    httpserver_put_chunk_hdr(hdr, length);
+    if (httpserver_send(conn, hdr, sizeof(hdr), TCP_WRITE_FLAG_COPY) < 0 ||
+        httpserver_send(conn, data, length, flags) < 0 ||
+        httpserver_send(conn, "\r\n", 2, TCP_WRITE_FLAG_COPY) < 0)
+        return -1;
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_write_data(httpconn_t *conn, const void *data, size_t length)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = p + length;
+
+    if (conn->in_body && conn->no_body)
+        return length;
+
+    while (p < end && !conn->write_failed) {
+        size_t block = end - p;
+
+        // Full segments bypass the staging buffer
+        if (!conn->out_len && block >= HTTP_OUT_BUF_SIZE) {
+            block = HTTP_OUT_BUF_SIZE;
+            if (conn->chunked) {
+                if (httpserver_send_chunk(conn, p, block, TCP_WRITE_FLAG_COPY) < 0)
+                    break;
+            } else if (httpserver_send(conn, p, block, TCP_WRITE_FLAG_COPY) < 0) {
+                break;
+            }
+            p += block;
+            continue;
+        }
+
+        if (!httpserver_out_reserve(conn))
+            break;
+        size_t limit = httpserver_out_limit(conn);
+        if (block > limit - conn->out_len)
+            block = limit - conn->out_len;
+        memcpy(conn->out + conn->out_len, p, block);
+        conn->out_len += block;
+        p += block;
+
+        if (conn->out_len == limit)
+            httpserver_flush(conn);
+    }
+    if (conn->in_body)
+        conn->body_sent += p - (const uint8_t*)data;
+    return p - (const uint8_t*)data;
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_copy_flash(void *dst, const void *src, size_t length)
+{
+    const uint32_t *w = (const uint32_t *)((uint32_t)src & ~3);
+    int skip = (uint32_t)src & 3;
+    uint8_t *d = dst;
+
+    while (length) {
+        uint32_t word = *w++;
+        for (int i = skip; i < 4 && length; i++, length--)
+            *d++ = word >> (8 * i);
+        skip = 0;
+    }
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_write_static(httpconn_t *conn, const void *data, size_t length)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = p + length;
+
+    if (conn->in_body && conn->no_body)
+        return length;
+
+    // Flash only takes aligned word loads, so it is always copied here
+    // whatever the length, never by write_data()'s memcpy
+    if ((uint32_t)data >= HTTP_FLASH_START && (uint32_t)data < HTTP_FLASH_END) {
+        while (p < end && !conn->write_failed) {
+            if (!httpserver_out_reserve(conn))
+                break;
+            size_t limit = httpserver_out_limit(conn);
+            size_t block = end - p;
+            if (block > limit - conn->out_len)
+                block = limit - conn->out_len;
+            httpserver_copy_flash(conn->out + conn->out_len, p, block);
+            conn->out_len += block;
+            p += block;
+            if (conn->out_len == limit)
+                httpserver_flush(conn);
+        }
+    } else if (length < HTTP_STATIC_MIN_SIZE) {
+        return httpserver_write_data(conn, data, length);
+    } else {
+        // lwIP references the data until it is ACKed, which is fine since
+        // it never changes or goes away
+        if (httpserver_flush(conn) == 0) {
+            if (conn->chunked) {
+                // Chunk sizes are 4 hex digits
+                while (p < end) {
+                    size_t block = end - p;
+                    if (block > HTTP_OUT_BUF_SIZE)
+                        block = HTTP_OUT_BUF_SIZE;
+                    if (httpserver_send_chunk(conn, p, block, 0) < 0)
+                        break;
+                    p += block;
+                }
+            } else if (httpserver_send(conn, data, length, 0) == 0) {
+                p = end;
+            }
+        }
+    }
+    if (conn->in_body)
+        conn->body_sent += p - (const uint8_t*)data;
+    return p - (const uint8_t*)data;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_write_string(httpconn_t *conn, const char *data)
+{
+    return httpserver_write_data(conn, data, strlen(data));
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_putc(char c, void *arg)
+{
+    httpconn_t *conn = arg;
+
+    // The formatter ends with a NUL that is not part of the output
+    if (!c || conn->write_failed)
+        return;
+    if (!httpserver_out_reserve(conn))
+        return;
+    conn->out[conn->out_len++] = c;
+    if (conn->out_len == httpserver_out_limit(conn))
+        httpserver_flush(conn);
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_printf(httpconn_t *conn, const char *fmt, ...)
+{
+    va_list va;
+
+    if (conn->in_body && conn->no_body)
+        return 0;
+
+    va_start(va, fmt);
+    int len = vfctprintf(httpserver_putc, conn, fmt, va);
+    va_end(va);
+    if (conn->in_body)
+        conn->body_sent += len;
+    return len;
+}
+
+#ifdef HTTP_STACKLESS
+
+// Run the body writer until it is done or the send buffer is nearly full.
+// The sent callback resumes it once ACKs free up space; data is in flight
+// whenever the buffer is short, so that callback is bound to come.
+ICACHE_FLASH_ATTR
+static void httpserver_run_writer(httpconn_t *conn)
+{
+    while (conn->writer && !conn->out_queue && !conn->write_failed &&
+           tcp_sndbuf(conn->tcpb) >= HTTP_OUT_BUF_SIZE) {
+        conn->writer_step = conn->writer(conn, conn->writer_step);
+        if (conn->writer_step == HTTP_WRITER_DONE)
+            conn->writer = NULL;
+    }
+    if (conn->write_failed)
+        conn->writer = NULL;
+    tcp_output(conn->tcpb);
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_write_steps(httpconn_t *conn, http_writer_t fn)
+{
+    if (conn->in_body && conn->no_body)
+        return 0;
+    conn->writer = fn;
+    conn->writer_step = 0;
+    httpserver_run_writer(conn);
+    return conn->write_failed ? -1 : 0;
+}
+
+#else
+
+ICACHE_FLASH_ATTR
+int httpserver_write_steps(httpconn_t *conn, http_writer_t fn)
+{
+    uint32_t step = 0;
+
+    if (conn->in_body && conn->no_body)
+        return 0;
+    // Writes wait for buffer space, so the steps can simply run in a row
+    while (step != HTTP_WRITER_DONE && !conn->write_failed)
+        step = fn(conn, step);
+    return conn->write_failed ? -1 : 0;
+}
+
+#endif
+
+#ifndef HTTP_STACKLESS
+
+ICACHE_FLASH_ATTR
+int httpserver_read_header(httpconn_t *conn, char **header, char **value)
+{
+    if (conn->no_more_headers)
+        return 0;
+
+    while (!header && !value) {
+        size_t len = httpserver_wait_line(conn, sizeof(conn->request) - 1);
+        int tracked = 0;
+
+        for (int i = 0; httpserver_tracked_headers[i]; i++) {
+            if (httpserver_peek_header(conn, httpserver_tracked_headers[i])) {
+                tracked = 1;
+                break;
+            }
+        }
+        if (tracked)
+            break;
+
+        // Blank line (or nothing at all) ends the headers
+        if (len <= 2) {
+            char tmp[2];
+            httpserver_copy_out(conn, tmp, len);
+            if (!len || tmp[0] == '\n' || tmp[0] == '\r') {
+                httpserver_consume(conn, len);
+                conn->no_more_headers = 1;
+                httpserver_set_phase(conn, HTTP_PHASE_BUSY);
+                return 0;
+            }
+        }
+        httpserver_skip_line(conn);
+        return 1;
+    }
+
+    httpserver_readline(conn, conn->request, sizeof(conn->request));
+
+    if (!conn->request[0]) {
+        conn->no_more_headers = 1;
+        httpserver_set_phase(conn, HTTP_PHASE_BUSY);
+        return 0;
+    }
+
+    char *phdr = conn->request;
+    char *pval = strchr(phdr, ':');
+
+    if (pval) {
+        *pval++ = '\0';
+        if (*pval == ' ')
+            *pval++ = '\0';
+        httpserver_process_header(conn, phdr, pval);
+    }
+
+    if (header)
+        *header = phdr;
+    if (value)
+        *value = pval;
+
+//     os_printf("HDR: %s='%s'\n", phdr, pval);
+    return 1;
+}
+
+#else /* HTTP_STACKLESS */
+
+ICACHE_FLASH_ATTR
+int httpserver_read_header(httpconn_t *conn, char **header, char **value)
+{
+    // The parser has consumed the headers before the handler runs
+    return 0;
+}
+
+#endif /* HTTP_STACKLESS */
+
+ICACHE_FLASH_ATTR
+int httpserver_read_body(httpconn_t *conn, void *buf, size_t size)
+{
+    httpserver_end_request(conn);
+    if (conn->body_chunked) {
+        // Cannot tell where the body ends, so neither can the next request
+        conn->keepalive = 0;
+        return -1;
+    }
+    if (!conn->body_left)
+        return 0;
+
+#ifndef HTTP_STACKLESS
+    while (!httpserver_queued(conn)) {
+        if (conn->eof)
+            return -1;
+        httpserver_set_phase(conn, HTTP_PHASE_BODY);
+        httpserver_wait_data(conn);
+    }
+    httpserver_set_phase(conn, HTTP_PHASE_BUSY);
+#endif
+
+    // The stackless engine only runs the handler once the body is queued
+    size_t n = httpserver_queued(conn);
+    if (!n)
+        return -1;
+    if (n > size)
+        n = size;
+    if (n > conn->body_left)
+        n = conn->body_left;
+    httpserver_copy_out(conn, buf, n);
+    httpserver_consume(conn, n);
+    conn->body_left -= n;
+    return n;
+}
+
+// Discard what the handler did not read of the request body
+ICACHE_FLASH_ATTR
+static void httpserver_skip_body(httpconn_t *conn)
+{
+    if (conn->body_chunked || conn->body_left > HTTP_BODY_DRAIN_MAX) {
+        conn->keepalive = 0;
+        return;
+    }
+    while (conn->body_left) {
+        size_t n = httpserver_queued(conn);
+        if (n > conn->body_left)
+            n = conn->body_left;
+        httpserver_consume(conn, n);
+        conn->body_left -= n;
+        if (!conn->body_left)
+            break;
+#ifndef HTTP_STACKLESS
+        if (conn->eof)
+            break;
+        httpserver_set_phase(conn, HTTP_PHASE_BODY);
+        httpserver_wait_data(conn);
+#else
+        break;
+#endif
+    }
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_get_method(httpconn_t *conn)
+{
+    return conn->method_id;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_end_request(httpconn_t *conn)
+{
+    while (httpserver_read_header(conn, NULL, NULL));
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_start_response(httpconn_t *conn, int code, const char *text)
+{
+    char buf[32];
+
+    // The whole request must be consumed before the connection can be reused
+    httpserver_end_request(conn);
+
+    os_sprintf(buf, "HTTP/1.1 %d ", code);
+    httpserver_write_string(conn, buf);
+    httpserver_write_string(conn, text);
+    httpserver_write_string(conn, "\r\n");
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_send_header(httpconn_t *conn, const char *header, const char *value)
+{
+    if (httpserver_strcaseeq(header, "Content-Length"))
+        conn->content_length = atoi(value);
+
+    httpserver_write_string(conn, header);
+    httpserver_write_string(conn, ": ");
+    httpserver_write_string(conn, value);
+    httpserver_write_string(conn, "\r\n");
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_send_content_length(httpconn_t *conn, size_t length)
+{
+    char buf[12];
+    os_sprintf(buf, "%d", length);
+    return httpserver_send_header(conn, "Content-Length", buf);
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_end_headers(httpconn_t *conn)
+{
+    // Without a length the body is chunked, or for HTTP/1.0 clients ends
+    // when the connection is closed
+    int chunked = conn->content_length < 0 && conn->http11 && !conn->no_body &&
+                  !conn->subscriber;
+
+    if (conn->content_length < 0 && !chunked && !conn->no_body)
+        conn->keepalive = 0;
+    if (conn->requests + 1 >= HTTP_KEEPALIVE_MAX_REQUESTS)
+        conn->keepalive = 0;
+
+    if (conn->etag)
+        httpserver_send_header(conn, "ETag", conn->etag);
+    if (conn->last_modified) {
+        char date[30];
+        httpserver_format_date(date, conn->last_modified);
+        httpserver_send_header(conn, "Last-Modified", date);
+    }
+    if (chunked)
+        httpserver_write_string(conn, "Transfer-Encoding: chunked\r\n");
+    if (conn->keepalive)
+        httpserver_write_string(conn, "Connection: keep-alive\r\n\r\n");
+    else
+        httpserver_write_string(conn, "Connection: close\r\n\r\n");
+    conn->in_body = 1;
+    conn->chunked = chunked;
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_send_error(httpconn_t *conn, int code, const char *text, const char *body)
+{
+    httpserver_end_request(conn);
+    httpserver_start_response(conn, code, text);
+    httpserver_send_header(conn, "Content-Type", "text/plain");
+    httpserver_send_content_length(conn, strlen(body));
+    httpserver_end_headers(conn);
+    httpserver_write_string(conn, body);
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_accepts_gzip(httpconn_t *conn)
+{
+    return conn->accept_gzip;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_conditional(httpconn_t *conn, const char *etag, uint32_t last_modified)
+{
+    int match = 0;
+
+    httpserver_end_request(conn);
+    conn->etag = etag;
+    conn->last_modified = last_modified;
+
+    // If-None-Match takes precedence, and uses weak comparison
+    if (conn->if_none_match[0]) {
+        if (etag && etag[0] == 'W' && etag[1] == '/')
+            etag += 2;
+        match = etag && (!strcmp(conn->if_none_match, "*") ||
+                         strstr(conn->if_none_match, etag));
+    } else if (conn->if_modified_since) {
+        match = last_modified && last_modified <= conn->if_modified_since;
+    }
+    if (!match)
+        return 0;
+
+    httpserver_start_response(conn, 304, "Not Modified");
+    conn->no_body = 1;
+    httpserver_end_headers(conn);
+    conn->hs->stats.not_modified++;
+    return 1;
+}
+
+// Connections held open indefinitely (subscribers and WebSockets)
+ICACHE_FLASH_ATTR
+static int httpserver_long_lived(httpserver_t *hs)
+{
+    int count = 0;
+
+    for (int i = 0; i < hs->maxconns; i++) {
+        httpconn_t *conn = &hs->conns[i];
+        if (!conn->used)
+            continue;
+#ifndef HTTP_STACKLESS
+        if (conn->websocket)
+            count++;
+        else
+#endif
+        if (conn->subscriber)
+            count++;
+    }
+    return count;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_subscribe(httpconn_t *conn)
+{
+    httpserver_t *hs = conn->hs;
+
+    // Keep a slot for ordinary requests
+    if (httpserver_long_lived(hs) >= hs->maxconns - 1 || conn->no_body)
+        return -1;
+
+    conn->subscriber = HTTP_SUBSCRIBER_PENDING;
+    // The stream ends when either side closes
+    conn->keepalive = 0;
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+void httpserver_broadcast(httpserver_t *hs, const void *data, size_t length)
+{
+    for (int i = 0; i < hs->maxconns; i++) {
+        httpconn_t *conn = &hs->conns[i];
+
+        if (!conn->used || conn->exited || conn->write_failed ||
+            conn->subscriber != HTTP_SUBSCRIBER_STREAMING)
+            continue;
+
+        // Never queue behind a slow client, it just misses this event
+        if (conn->congested || conn->out_len ||
+#ifdef HTTP_STACKLESS
+            conn->out_queue ||
+#endif
+            tcp_sndbuf(conn->tcpb) < length ||
+            tcp_sndqueuelen(conn->tcpb) >= TCP_SND_QUEUELEN / 2) {
+            conn->congested = 1;
+            hs->stats.events_dropped++;
+            continue;
+        }
+
+        err_t ret = tcp_write(conn->tcpb, data, length, TCP_WRITE_FLAG_COPY);
+        trace(TRACE_WRITE, i, length, ret);
+        if (ret == ERR_OK) {
+            tcp_output(conn->tcpb);
+            hs->stats.events_sent++;
+            hs->stats.bytes_out += length;
+        } else {
+            if (ret != ERR_MEM) {
+                // Closed from the poll callback
+                conn->write_failed = 1;
+            }
+            conn->congested = 1;
+            hs->stats.events_dropped++;
+        }
+    }
+}
+
+#ifndef HTTP_STACKLESS
+
+static const char httpserver_ws_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+ICACHE_FLASH_ATTR
+static void httpserver_base64(char *out, const uint8_t *in, size_t len)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for (; len >= 3; len -= 3, in += 3) {
+        uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+        *out++ = alphabet[v >> 18];
+        *out++ = alphabet[(v >> 12) & 63];
+        *out++ = alphabet[(v >> 6) & 63];
+        *out++ = alphabet[v & 63];
+    }
+    if (len) {
+        uint32_t v = (in[0] << 16) | (len > 1 ? in[1] << 8 : 0);
+        *out++ = alphabet[v >> 18];
+        *out++ = alphabet[(v >> 12) & 63];
+        *out++ = len > 1 ? alphabet[(v >> 6) & 63] : '=';
+        *out++ = '=';
+    }
+    *out = '\0';
+}
+
+// Server frames are never masked or fragmented
+ICACHE_FLASH_ATTR
+static int httpserver_ws_send_frame(httpconn_t *conn, int opcode, const void *data, size_t length)
+{
+    uint8_t hdr[10];
+    size_t n;
+
+    hdr[0] = 0x80 | opcode;
+    if (length < 126) {
+        hdr[1] = length;
+        n = 2;
+    } else if (length <= 0xffff) {
+        hdr[1] = 126;
+        hdr[2] = length >> 8;
+        hdr[3] = length;
+        n = 4;
+    } else {
+        hdr[1] = 127;
+        memset(hdr + 2, 0, 4);
+        hdr[6] = length >> 24;
+        hdr[7] = length >> 16;
+        hdr[8] = length >> 8;
+        hdr[9] = length;
+        n = 10;
+    }
+
+    httpserver_write_data(conn, hdr, n);
+    httpserver_write_data(conn, data, length);
+    if (httpserver_flush(conn) < 0 || conn->write_failed)
+        return -1;
+    tcp_output(conn->tcpb);
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_ws_close(httpconn_t *conn, int code)
+{
+    uint8_t payload[2] = { code >> 8, code };
+
+    if (conn->ws_closed)
+        return;
+    conn->ws_closed = 1;
+    httpserver_ws_send_frame(conn, HTTP_WS_CLOSE, payload, sizeof(payload));
+}
+
+// Read len bytes of a frame, waiting for them as needed; a NULL buf
+// discards them. Returns -1 if the connection closed first.
+ICACHE_FLASH_ATTR
+static int httpserver_ws_recv(httpconn_t *conn, uint8_t *buf, size_t len)
+{
+    while (len) {
+        size_t n = httpserver_queued(conn);
+        if (!n) {
+            if (conn->eof)
+                return -1;
+            httpserver_wait_data(conn);
+            continue;
+        }
+        if (n > len)
+            n = len;
+        if (buf) {
+            httpserver_copy_out(conn, (char *)buf, n);
+            buf += n;
+        }
+        httpserver_consume(conn, n);
+        len -= n;
+    }
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_ws_unmask(uint8_t *buf, size_t len, const uint8_t *mask)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] ^= mask[i & 3];
+}
+
+// Wait for the start of a frame, pinging the client if it has been quiet
+ICACHE_FLASH_ATTR
+static int httpserver_ws_wait(httpconn_t *conn, int wakeable)
+{
+    while (!httpserver_queued(conn)) {
+        if (conn->eof || conn->write_failed)
+            return HTTP_WS_CLOSED;
+        if (wakeable && conn->ws_woken) {
+            conn->ws_woken = 0;
+            return HTTP_WS_WOKEN;
+        }
+        uint32_t now = system_get_time();
+        if (!conn->ws_ping_pending && now - conn->ws_last_rx > HTTP_WS_PING_INTERVAL_MS * 1000) {
+            conn->ws_ping_pending = 1;
+            conn->ws_ping_since = now;
+            httpserver_ws_send_frame(conn, HTTP_WS_PING, NULL, 0);
+        }
+        httpserver_wait_data(conn);
+    }
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_ws_accept(httpconn_t *conn)
+{
+    httpserver_t *hs = conn->hs;
+    char buf[HTTP_WS_KEY_SIZE + sizeof(httpserver_ws_guid)];
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    char accept[32];
+
+    httpserver_end_request(conn);
+    if (conn->method_id != HTTP_METHOD_GET || !conn->upgrade ||
+        !conn->connection_upgrade || conn->ws_version != 13) {
+        httpserver_start_response(conn, 426, "Upgrade Required");
+        httpserver_send_header(conn, "Upgrade", "websocket");
+        httpserver_send_header(conn, "Sec-WebSocket-Version", "13");
+        httpserver_send_content_length(conn, 0);
+        httpserver_end_headers(conn);
+        return -1;
+    }
+    if (!conn->ws_key[0]) {
+        httpserver_send_error(conn, 400, "Bad Request", "Invalid Sec-WebSocket-Key");
+        return -1;
+    }
+    // Keep a slot for ordinary requests
+    if (httpserver_long_lived(hs) >= hs->maxconns - 1) {
+        httpserver_start_response(conn, 503, "Service Unavailable");
+        httpserver_send_content_length(conn, 0);
+        httpserver_end_headers(conn);
+        return -1;
+    }
+
+    memcpy(buf, conn->ws_key, HTTP_WS_KEY_SIZE);
+    memcpy(buf + HTTP_WS_KEY_SIZE, httpserver_ws_guid, sizeof(httpserver_ws_guid) - 1);
+    sha1(buf, HTTP_WS_KEY_SIZE + sizeof(httpserver_ws_guid) - 1, digest);
+    httpserver_base64(accept, digest, sizeof(digest));
+
+    httpserver_start_response(conn, 101, "Switching Protocols");
+    httpserver_send_header(conn, "Upgrade", "websocket");
+    httpserver_send_header(conn, "Connection", "Upgrade");
+    httpserver_send_header(conn, "Sec-WebSocket-Accept", accept);
+    httpserver_write_string(conn, "\r\n");
+    conn->in_body = 1;
+    conn->keepalive = 0;
+    conn->websocket = 1;
+    conn->ws_last_rx = system_get_time();
+    if (httpserver_flush(conn) < 0)
+        return -1;
+    tcp_output(conn->tcpb);
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_ws_read(httpconn_t *conn, void *buf, size_t size, int *opcode)
+{
+    uint8_t *p = buf;
+    size_t len = 0;
+    int msg_op = 0;
+
+    if (!conn->websocket || conn->ws_closed)
+        return HTTP_WS_CLOSED;
+    // Anything staged goes out before waiting
+    if (httpserver_flush(conn) < 0)
+        return HTTP_WS_CLOSED;
+    tcp_output(conn->tcpb);
+
+    for (;;) {
+        uint8_t hdr[8], mask[4], ctl[HTTP_WS_CONTROL_MAX];
+
+        // Waking up halfway through a fragmented message would lose it
+        int ret = httpserver_ws_wait(conn, !msg_op);
+        if (ret < 0)
+            return ret;
+        if (httpserver_ws_recv(conn, hdr, 2) < 0)
+            return HTTP_WS_CLOSED;
+
+        int fin = hdr[0] & 0x80;
+        int op = hdr[0] & 0x0f;
+        uint32_t frame_len = hdr[1] & 0x7f;
+
+        // Reserved bits need an extension, and clients must mask
+        if ((hdr[0] & 0x70) || !(hdr[1] & 0x80))
+            goto protocol_error;
+        if (frame_len == 126) {
+            if (httpserver_ws_recv(conn, hdr, 2) < 0)
+                return HTTP_WS_CLOSED;
+            frame_len = (hdr[0] << 8) | hdr[1];
+        } else if (frame_len == 127) {
+            if (httpserver_ws_recv(conn, hdr, 8) < 0)
+                return HTTP_WS_CLOSED;
+            // Nothing near 2GB will ever arrive here
+            if (hdr[0] || hdr[1] || hdr[2] || hdr[3] || (hdr[4] & 0x80))
+                goto protocol_error;
+            frame_len = (hdr[4] << 24) | (hdr[5] << 16) | (hdr[6] << 8) | hdr[7];
+        }
+        if (httpserver_ws_recv(conn, mask, 4) < 0)
+            return HTTP_WS_CLOSED;
+        conn->ws_last_rx = system_get_time();
+
+        if (op & 8) {
+            // Control frames may come between the fragments of a message
+            if (!fin || frame_len > HTTP_WS_CONTROL_MAX)
+                goto protocol_error;
+            if (httpserver_ws_recv(conn, ctl, frame_len) < 0)
+                return HTTP_WS_CLOSED;
+            httpserver_ws_unmask(ctl, frame_len, mask);
+
+            if (op == HTTP_WS_PING) {
+                httpserver_ws_send_frame(conn, HTTP_WS_PONG, ctl, frame_len);
+            } else if (op == HTTP_WS_PONG) {
+                conn->ws_ping_pending = 0;
+            } else if (op == HTTP_WS_CLOSE) {
+                // Echo the status code back
+                if (!conn->ws_closed) {
+                    conn->ws_closed = 1;
+                    httpserver_ws_send_frame(conn, HTTP_WS_CLOSE, ctl, frame_len >= 2 ? 2 : 0);
+                }
+                return HTTP_WS_CLOSED;
+            } else {
+                goto protocol_error;
+            }
+            continue;
+        }
+
+        if (op == HTTP_WS_CONTINUATION ? !msg_op : (msg_op || op > HTTP_WS_BINARY))
+            goto protocol_error;
+        if (op != HTTP_WS_CONTINUATION)
+            msg_op = op;
+
+        // Whatever does not fit is dropped
+        size_t n = frame_len < size - len ? frame_len : size - len;
+        if (httpserver_ws_recv(conn, p + len, n) < 0 ||
+            httpserver_ws_recv(conn, NULL, frame_len - n) < 0)
+            return HTTP_WS_CLOSED;
+        // The mask restarts with every frame
+        httpserver_ws_unmask(p + len, n, mask);
+        len += n;
+
+        if (fin) {
+            *opcode = msg_op;
+            conn->hs->stats.ws_messages_in++;
+            return len;
+        }
+    }
+
+protocol_error:
+    LOG_WARN("httpserver: websocket protocol error\n");
+    httpserver_ws_close(conn, HTTP_WS_CLOSE_PROTOCOL_ERROR);
+    return HTTP_WS_CLOSED;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_ws_send(httpconn_t *conn, int opcode, const void *data, size_t length)
+{
+    if (!conn->websocket || conn->ws_closed)
+        return -1;
+    if (httpserver_ws_send_frame(conn, opcode, data, length) < 0)
+        return -1;
+    conn->hs->stats.ws_messages_out++;
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+void httpserver_ws_wake_all(httpserver_t *hs)
+{
+    for (int i = 0; i < hs->maxconns; i++) {
+        httpconn_t *conn = &hs->conns[i];
+
+        if (!conn->used || conn->exited || !conn->websocket || conn->ws_closed)
+            continue;
+        // Resumed from a timer, this may run from another continuation
+        conn->ws_woken = 1;
+        contwait_wake(&conn->wait);
+    }
+}
+
+#else /* HTTP_STACKLESS */
+
+ICACHE_FLASH_ATTR
+int httpserver_ws_accept(httpconn_t *conn)
+{
+    // Handlers cannot wait for frames without a coroutine of their own
+    httpserver_send_error(conn, 501, "Not Implemented", "WebSockets need the coroutine engine");
+    return -1;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_ws_read(httpconn_t *conn, void *buf, size_t size, int *opcode)
+{
+    return HTTP_WS_CLOSED;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_ws_send(httpconn_t *conn, int opcode, const void *data, size_t length)
+{
+    return -1;
+}
+
+ICACHE_FLASH_ATTR
+void httpserver_ws_wake_all(httpserver_t *hs)
+{
+}
+
+#endif /* HTTP_STACKLESS */
+
+ICACHE_FLASH_ATTR
+void httpserver_handle_404(httpconn_t *conn, const char *path, char *query_string)
+{
+    httpserver_send_error(conn, 404, "Not Found", "No handler at specified URL");
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_begin_request(httpconn_t *conn)
+{
+    conn->content_length = -1;
+    conn->in_body = 0;
+    conn->body_sent = 0;
+    conn->chunked = 0;
+    conn->chunk_open = 0;
+    conn->accept_gzip = 0;
+    conn->method_id = 0;
+    conn->body_left = 0;
+    conn->body_chunked = 0;
+    conn->no_body = 0;
+    conn->if_none_match[0] = '\0';
+    conn->if_modified_since = 0;
+    conn->etag = NULL;
+    conn->last_modified = 0;
+    // Pipelined requests are timed from when the server gets to them
+    conn->request_start = conn->recv_data ? system_get_time() : 0;
+    conn->handler_start = 0;
+#ifndef HTTP_STACKLESS
+    conn->upgrade = 0;
+    conn->connection_upgrade = 0;
+    conn->ws_version = 0;
+    conn->ws_key[0] = '\0';
+#endif
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_send_method_not_allowed(httpconn_t *conn, uint32_t allowed)
+{
+    char buf[32] = "";
+
+    // HEAD is implied by GET
+    if (allowed & HTTP_METHOD_GET)
+        strcat(buf, ", GET, HEAD");
+    if (allowed & HTTP_METHOD_POST)
+        strcat(buf, ", POST");
+    if (allowed & HTTP_METHOD_PUT)
+        strcat(buf, ", PUT");
+
+    httpserver_end_request(conn);
+    httpserver_start_response(conn, 405, "Method Not Allowed");
+    httpserver_send_header(conn, "Allow", buf[0] ? buf + 2 : "");
+    httpserver_send_content_length(conn, 0);
+    httpserver_end_headers(conn);
+}
+
+// FNV-1a
+ICACHE_FLASH_ATTR
+static uint32_t httpserver_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619;
+    }
+    return h;
+}
+
+// Look up routes for the first len bytes of path. Returns the one that
+// handles method, adding the methods of all matching routes to *allowed.
+ICACHE_FLASH_ATTR
+static const struct httproute *httpserver_lookup_route(httpserver_t *hs, const char *path, size_t len,
+                                                       int prefix, int method, uint32_t *allowed)
+{
+    uint32_t hash = httpserver_hash(path, len);
+
+    for (uint32_t i = hash & hs->route_mask; hs->route_index[i].route; i = (i + 1) & hs->route_mask) {
+        const struct httproute_slot *slot = &hs->route_index[i];
+        if (slot->hash != hash || slot->prefix != prefix)
+            continue;
+
+        const struct httproute *route = &hs->routes[slot->route - 1];
+        if (strncmp(route->path, path, len) || route->path[len] != (prefix ? '*' : '\0'))
+            continue;
+
+        *allowed |= route->methods;
+        if (route->methods & method)
+            return route;
+    }
+    return NULL;
+}
+
+// Exact routes win, then prefix routes from the longest prefix down
+ICACHE_FLASH_ATTR
+static const struct httproute *httpserver_find_route(httpserver_t *hs, const char *path,
+                                                     int method, uint32_t *allowed)
+{
+    const struct httproute *route;
+    size_t len = strlen(path);
+
+    if (!hs->route_index)
+        return NULL;
+    if (method == HTTP_METHOD_HEAD)
+        method |= HTTP_METHOD_GET;
+
+    route = httpserver_lookup_route(hs, path, len, 0, method, allowed);
+    if (route || *allowed)
+        return route;
+
+    for (; len > 0; len--) {
+        if (path[len - 1] != '/')
+            continue;
+        route = httpserver_lookup_route(hs, path, len, 1, method, allowed);
+        if (route || *allowed)
+            return route;
+    }
+    return NULL;
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_set_version(httpconn_t *conn, const char *version)
+{
+    conn->http11 = !strcmp(version, "HTTP/1.1");
+    conn->keepalive = conn->http11;
+}
+
+// Run the handler for a parsed request line
+ICACHE_FLASH_ATTR
+static void httpserver_dispatch(httpconn_t *conn, char *method, char *path)
+{
+    httpserver_t *hs = conn->hs;
+
+//     os_printf("method: '%s' path: '%s'\n", method, path);
+
+    if (!strcmp(method, "GET")) {
+        conn->method_id = HTTP_METHOD_GET;
+    } else if (!strcmp(method, "HEAD")) {
+        conn->method_id = HTTP_METHOD_HEAD;
+        // Handlers run as for GET, the body is dropped
+        conn->no_body = 1;
+    } else if (!strcmp(method, "POST")) {
+        conn->method_id = HTTP_METHOD_POST;
+    } else if (!strcmp(method, "PUT")) {
+        conn->method_id = HTTP_METHOD_PUT;
+    } else {
+        hs->stats.unrouted++;
+        trace(TRACE_HANDLER, httpserver_slot(conn), TRACE_NO_ROUTE, 0);
+        httpserver_send_method_not_allowed(conn, HTTP_METHOD_GET | HTTP_METHOD_POST | HTTP_METHOD_PUT);
+        return;
+    }
+
+    char *qs = strchr(path, '?');
+    if (qs) {
+        *qs++ = '\0';
+    }
+
+//     os_printf("path: '%s' query: '%s'\n", path, qs);
+
+    uint32_t allowed = 0;
+    const struct httproute *route = httpserver_find_route(hs, path, conn->method_id, &allowed);
+
+    if (route) {
+        if (hs->route_requests)
+            hs->route_requests[route - hs->routes]++;
+        conn->handler_start = system_get_time();
+        trace(TRACE_HANDLER, httpserver_slot(conn), route - hs->routes, 0);
+        route->handler(conn, path, qs);
+        return;
+    }
+
+    hs->stats.unrouted++;
+    trace(TRACE_HANDLER, httpserver_slot(conn), TRACE_NO_ROUTE, 0);
+    if (allowed) {
+        httpserver_send_method_not_allowed(conn, allowed);
+    } else {
+        httpserver_handle_404(conn, path, qs);
+    }
+}
+
+// Returns nonzero if the connection can be reused for another request
+ICACHE_FLASH_ATTR
+static int httpserver_finish_response(httpconn_t *conn)
+{
+    httpserver_t *hs = conn->hs;
+
+    httpserver_end_request(conn);
+    httpserver_skip_body(conn);
+    httpserver_ack(conn);
+    httpserver_flush(conn);
+    if (conn->chunked) {
+        conn->chunked = 0;
+        httpserver_send(conn, "0\r\n\r\n", 5, TCP_WRITE_FLAG_COPY);
+    }
+    tcp_output(conn->tcpb);
+    conn->requests++;
+    hs->stats.responses++;
+    trace(TRACE_RESPONSE, httpserver_slot(conn), conn->body_sent, conn->requests);
+
+    uint32_t now = system_get_time();
+#ifndef HTTP_STACKLESS
+    // A WebSocket handler runs for the whole session
+    if (conn->websocket)
+        conn->request_start = conn->handler_start = 0;
+#endif
+    if (conn->request_start)
+        histogram_record(&hs->stats.request_us, now - conn->request_start);
+    if (conn->handler_start)
+        histogram_record(&hs->stats.handler_us, now - conn->handler_start);
+
+    if (conn->content_length >= 0 && !conn->no_body &&
+        conn->body_sent != conn->content_length) {
+        LOG_ERROR("httpserver: body length mismatch (%d != %d)\n",
+                  (int)conn->body_sent, conn->content_length);
+        return 0;
+    }
+    return conn->keepalive && !conn->eof && !conn->write_failed;
+}
+
+#ifndef HTTP_STACKLESS
+
+ICACHE_FLASH_ATTR
+static int httpserver_handle_request(httpconn_t *conn)
+{
+    conn->no_more_headers = 0;
+    httpserver_begin_request(conn);
+
+    if (conn->requests && !conn->recv_data)
+        httpserver_set_phase(conn, HTTP_PHASE_IDLE);
+    else if (conn->requests)
+        httpserver_set_phase(conn, HTTP_PHASE_REQUEST_LINE);
+    httpserver_readline(conn, conn->request, sizeof(conn->request));
+    if (conn->eof && !conn->request[0])
+        return 0;
+    httpserver_set_phase(conn, HTTP_PHASE_HEADERS);
+    LOG_DEBUG("> %s\n", conn->request);
+
+    char *method = strtok(conn->request, " ");
+    char *path = strtok(NULL, " ");
+    char *version = strtok(NULL, " ");
+
+    if (!method || !path || !version || !*method || !*path || !*version)
+        return 0;
+
+    httpserver_set_version(conn, version);
+    httpserver_dispatch(conn, method, path);
+    // The handler is done with its WebSocket
+    if (conn->websocket)
+        httpserver_ws_close(conn, HTTP_WS_CLOSE_NORMAL);
+    int keepalive = httpserver_finish_response(conn);
+
+    if (conn->subscriber) {
+        // Broadcasts write to the connection directly from now on, stay
+        // parked until the client goes away
+        conn->subscriber = HTTP_SUBSCRIBER_STREAMING;
+        while (!conn->eof && !conn->write_failed) {
+            httpserver_consume(conn, httpserver_queued(conn));
+            httpserver_wait_data(conn);
+        }
+        return 0;
+    }
+    return keepalive;
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_handle_client(void *arg)
+{
+    httpconn_t *conn = arg;
+//     os_printf("httpserver_handle_client %08x\n", (uint32_t)arg);
+
+    while (httpserver_handle_request(conn));
+
+    tcp_output(conn->tcpb);
+    while (httpserver_must_linger(conn)) {
+        httpserver_consume(conn, httpserver_queued(conn));
+        httpserver_wait_data(conn);
+    }
+
+    httpserver_note_stack(conn);
+    httpserver_record_close(conn);
+    trace(TRACE_CLOSE, httpserver_slot(conn), 0, 0);
+    contwait_cancel(&conn->wait);
+    httpserver_discard(conn);
+    conn->exited = 1;
+    conn->used = 0;
+    tcp_arg(conn->tcpb, NULL);
+    if (tcp_close(conn->tcpb) != ERR_OK)
+        LOG_ERROR("tcp_close failed\n");
+//     os_printf("httpserver_handle_client returning\n");
+}
+
+#else /* HTTP_STACKLESS */
+
+ICACHE_FLASH_ATTR
+static err_t httpserver_close(httpconn_t *conn)
+{
+    err_t ret = ERR_OK;
+
+    httpserver_record_close(conn);
+    trace(TRACE_CLOSE, httpserver_slot(conn), 0, 0);
+    httpserver_discard(conn);
+    httpserver_free_out(conn);
+    conn->exited = 1;
+    conn->used = 0;
+    tcp_arg(conn->tcpb, NULL);
+    if (tcp_close(conn->tcpb) != ERR_OK) {
+        LOG_ERROR("tcp_close failed\n");
+        tcp_abort(conn->tcpb);
+        ret = ERR_ABRT;
+    }
+    httpserver_accept_pending(conn->hs);
+    return ret;
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_parser_reset(httpconn_t *conn)
+{
+    conn->state = HTTP_SM_METHOD;
+    conn->len = 0;
+    conn->overflow = 0;
+}
+
+// Append c to the current field, remembering if it did not fit
+ICACHE_FLASH_ATTR
+static void httpserver_parser_put(httpconn_t *conn, char *field, size_t size, char c)
+{
+    if (conn->len < size - 1)
+        field[conn->len++] = c;
+    else
+        conn->overflow = 1;
+}
+
+// Feed one byte to the request parser
+ICACHE_FLASH_ATTR
+static void httpserver_parse(httpconn_t *conn, char c)
+{
+    switch (conn->state) {
+    case HTTP_SM_METHOD:
+        if (c == ' ') {
+            conn->method[conn->len] = '\0';
+            conn->state = conn->len && !conn->overflow ? HTTP_SM_PATH : HTTP_SM_ERROR;
+            conn->len = 0;
+        } else if (c == '\r' || c == '\n') {
+            // Stray line ends between requests are allowed
+            if (conn->len)
+                conn->state = HTTP_SM_ERROR;
+        } else {
+            httpserver_parser_put(conn, conn->method, sizeof(conn->method), c);
+        }
+        break;
+    case HTTP_SM_PATH:
+        if (c == ' ') {
+            conn->path[conn->len] = '\0';
+            conn->state = conn->len ? HTTP_SM_VERSION : HTTP_SM_ERROR;
+            conn->len = 0;
+        } else if (c == '\r' || c == '\n') {
+            conn->state = HTTP_SM_ERROR;
+        } else {
+            httpserver_parser_put(conn, conn->path, sizeof(conn->path), c);
+        }
+        break;
+    case HTTP_SM_VERSION:
+        if (c == '\n') {
+            conn->version[conn->len] = '\0';
+            conn->state = HTTP_SM_HEADER_NAME;
+            conn->len = 0;
+            httpserver_set_version(conn, conn->version);
+            httpserver_set_phase(conn, HTTP_PHASE_HEADERS);
+        } else if (c != '\r' && conn->len < sizeof(conn->version) - 1) {
+            conn->version[conn->len++] = c;
+        }
+        break;
+    case HTTP_SM_HEADER_NAME:
+        if (c == '\n') {
+            // Blank line ends the request, lines without a colon are ignored
+            if (!conn->len)
+                conn->state = HTTP_SM_DONE;
+            conn->len = 0;
+        } else if (c == ':') {
+            conn->name[conn->len < sizeof(conn->name) ? conn->len : 0] = '\0';
+            conn->tracked = conn->len < sizeof(conn->name) && httpserver_is_tracked(conn->name);
+            conn->state = HTTP_SM_HEADER_VALUE;
+            conn->len = 0;
+        } else if (c != '\r') {
+            // Names that do not fit cannot be tracked ones
+            if (conn->len < sizeof(conn->name) - 1)
+                conn->name[conn->len] = c;
+            if (conn->len < 255)
+                conn->len++;
+        }
+        break;
+    case HTTP_SM_HEADER_VALUE:
+        if (c == '\n') {
+            if (conn->tracked) {
+                conn->value[conn->len] = '\0';
+                httpserver_process_header(conn, conn->name, conn->value);
+            }
+            conn->state = HTTP_SM_HEADER_NAME;
+            conn->len = 0;
+        } else if (c == '\r' || ((c == ' ' || c == '\t') && !conn->len)) {
+            // Skip leading whitespace and the line terminator
+        } else if (conn->tracked && conn->len < sizeof(conn->value) - 1) {
+            conn->value[conn->len++] = c;
+        }
+        break;
+    }
+}
+
+// Wrap up a response once its body is written. Returns 0 if the
+// connection is to be closed once the queued output is out.
+ICACHE_FLASH_ATTR
+static int httpserver_sm_finish(httpconn_t *conn)
+{
+    int keepalive = httpserver_finish_response(conn);
+
+    if (conn->out) {
+        os_free(conn->out);
+        conn->out = NULL;
+    }
+    httpserver_parser_reset(conn);
+    if (conn->subscriber) {
+        conn->subscriber = HTTP_SUBSCRIBER_STREAMING;
+        return 1;
+    }
+    if (!keepalive) {
+        conn->closing = 1;
+        return 0;
+    }
+    if (!conn->out_queue)
+        httpserver_set_phase(conn, conn->recv_data ? HTTP_PHASE_REQUEST_LINE : HTTP_PHASE_IDLE);
+    return 1;
+}
+
+// Parse queued request data and run handlers for complete requests.
+// Returns ERR_ABRT if the connection was aborted.
+ICACHE_FLASH_ATTR
+static err_t httpserver_process(httpconn_t *conn)
+{
+    if (conn->subscriber == HTTP_SUBSCRIBER_STREAMING) {
+        // Nothing more is expected from the client
+        httpserver_consume(conn, httpserver_queued(conn));
+        httpserver_ack(conn);
+        if (conn->eof)
+            return httpserver_close(conn);
+        return ERR_OK;
+    }
+
+    // A response is still being sent, pipelined requests wait for it
+    while (!conn->out_queue && !conn->writer) {
+        while (conn->recv_data && conn->state < HTTP_SM_DONE) {
+            struct pbuf *q = conn->recv_data;
+            const char *payload = q->payload;
+            size_t n = 0;
+
+            if (conn->state == HTTP_SM_METHOD && !conn->len)
+                httpserver_begin_request(conn);
+
+            while (conn->recv_off + n < q->len && conn->state < HTTP_SM_DONE)
+                httpserver_parse(conn, payload[conn->recv_off + n++]);
+            httpserver_consume(conn, n);
+        }
+
+        if (conn->state == HTTP_SM_ERROR)
+            return httpserver_close(conn);
+        if (conn->state != HTTP_SM_DONE)
+            break;
+
+        // Handlers cannot wait, so the whole body has to be queued first
+        if (!conn->body_chunked && conn->body_left <= HTTP_RECV_QUEUE_MAX &&
+            httpserver_queued(conn) < conn->body_left) {
+            if (conn->eof)
+                return httpserver_close(conn);
+            if (conn->phase != HTTP_PHASE_BODY)
+                httpserver_set_phase(conn, HTTP_PHASE_BODY);
+            break;
+        }
+
+        httpserver_set_phase(conn, HTTP_PHASE_BUSY);
+        LOG_DEBUG("> %s %s %s\n", conn->method, conn->path, conn->version);
+        if (conn->overflow || conn->body_chunked || conn->body_left > HTTP_RECV_QUEUE_MAX)
+            trace(TRACE_HANDLER, httpserver_slot(conn), TRACE_NO_ROUTE, 0);
+        if (conn->overflow) {
+            conn->keepalive = 0;
+            httpserver_send_error(conn, 414, "URI Too Long", "Request path too long");
+        } else if (conn->body_chunked) {
+            httpserver_send_error(conn, 411, "Length Required", "Chunked request bodies are not supported");
+        } else if (conn->body_left > HTTP_RECV_QUEUE_MAX) {
+            httpserver_send_error(conn, 413, "Payload Too Large", "Request body too large");
+        } else {
+            httpserver_dispatch(conn, conn->method, conn->path);
+        }
+        // The rest of the body is written from the sent callback
+        if (conn->writer)
+            break;
+        if (!httpserver_sm_finish(conn)) {
+            // Close once the queued output has been sent
+            if (conn->out_queue || httpserver_must_linger(conn))
+                return ERR_OK;
+            return httpserver_close(conn);
+        }
+        if (conn->subscriber)
+            return httpserver_process(conn);
+    }
+
+    httpserver_ack(conn);
+    if (conn->eof && !conn->out_queue && !conn->writer)
+        return httpserver_close(conn);
+    return ERR_OK;
+}
+
+#endif /* HTTP_STACKLESS */
+
+ICACHE_FLASH_ATTR
+static err_t httpserver_recv(void *arg, struct tcp_pcb *tcpb, struct pbuf *p, err_t err)
+{
+    httpconn_t *conn = arg;
+//     os_printf("httpserver_recv %08x\n", (uint32_t)conn);
+    if (!conn) {
+        if (p || err != ERR_OK)
+            LOG_WARN("zombie httpserver_recv: %p, %d\n", p, err);
+        return ERR_OK;
+    }
+    trace(TRACE_RECV, httpserver_slot(conn), p ? p->tot_len : 0, 0);
+#ifdef HTTP_STACKLESS
+    if (conn->closing) {
+        // Nothing more is read, only kept from resetting the connection
+        // until the response is out
+        if (p) {
+            tcp_recved(tcpb, p->tot_len);
+            pbuf_free(p);
+        } else {
+            conn->eof = 1;
+        }
+        if (conn->out_queue || httpserver_must_linger(conn))
+            return ERR_OK;
+        return httpserver_close(conn);
+    }
+#endif
+    if (!p) {
+        conn->eof = 1;
+#ifdef HTTP_STACKLESS
+        return httpserver_process(conn);
+#else
+        httpserver_run_client(conn);
+        return ERR_OK;
+#endif
+    }
+    if (conn->phase == HTTP_PHASE_IDLE)
+        httpserver_set_phase(conn, HTTP_PHASE_REQUEST_LINE);
+    if (!conn->request_start)
+        conn->request_start = system_get_time();
+    // lwIP holds on to refused data and redelivers it later
+    if (conn->hs->queued_bytes + p->tot_len > HTTP_QUEUE_BUDGET) {
+        LOG_WARN("httpserver_recv over budget, refusing data\n");
+        return ERR_MEM;
+    }
+    if (conn->recv_data) {
+        if (conn->recv_data->tot_len - conn->recv_off + p->tot_len > HTTP_RECV_QUEUE_MAX) {
+            LOG_WARN("httpserver_recv queue full, refusing data\n");
+            return ERR_MEM;
+        }
+        pbuf_cat(conn->recv_data, p);
+    } else {
+        conn->recv_data = p;
+    }
+    conn->hs->queued_bytes += p->tot_len;
+    conn->hs->stats.bytes_in += p->tot_len;
+#ifdef HTTP_STACKLESS
+    return httpserver_process(conn);
+#else
+    httpserver_run_client(conn);
+    return ERR_OK;
+#endif
+}
+
+ICACHE_FLASH_ATTR
+static err_t httpserver_sent(void *arg, struct tcp_pcb *tcpb, u16_t len)
+{
+    httpconn_t *conn = arg;
+    if (!conn)
+        return ERR_OK;
+    trace(TRACE_SENT, httpserver_slot(conn), len, 0);
+    conn->send_progress = system_get_time();
+    // A congested subscriber gets events again once it has caught up
+    if (conn->congested && !tcp_sndqueuelen(tcpb))
+        conn->congested = 0;
+#ifdef HTTP_STACKLESS
+    httpserver_drain(conn);
+    if (conn->writer) {
+        httpserver_run_writer(conn);
+        if (!conn->writer && !conn->write_failed)
+            httpserver_sm_finish(conn);
+    }
+    if (conn->write_failed)
+        return httpserver_close(conn);
+    if (conn->out_queue || conn->writer || conn->subscriber == HTTP_SUBSCRIBER_STREAMING)
+        return ERR_OK;
+    if (conn->closing)
+        return httpserver_must_linger(conn) ? ERR_OK : httpserver_close(conn);
+    if (conn->phase == HTTP_PHASE_BUSY)
+        httpserver_set_phase(conn, conn->recv_data ? HTTP_PHASE_REQUEST_LINE : HTTP_PHASE_IDLE);
+    // Continue with pipelined requests
+    return httpserver_process(conn);
+#else
+    httpserver_run_client(conn);
+    return ERR_OK;
+#endif
+}
+
+// Drop a connection without a graceful close
+ICACHE_FLASH_ATTR
+static err_t httpserver_abort(httpconn_t *conn)
+{
+#ifdef HTTP_STACKLESS
+    httpserver_free_out(conn);
+#else
+    contwait_cancel(&conn->wait);
+    httpserver_note_stack(conn);
+    cont_release(&conn->cont);
+#endif
+    httpserver_record_close(conn);
+    trace(TRACE_CLOSE, httpserver_slot(conn), 1, 0);
+    httpserver_free_recv(conn);
+    conn->exited = 1;
+    conn->used = 0;
+    tcp_arg(conn->tcpb, NULL);
+    tcp_abort(conn->tcpb);
+    httpserver_accept_pending(conn->hs);
+    return ERR_ABRT;
+}
+
+// Whether a connection sits between keep-alive requests with nothing in
+// flight, so it can be closed for a queued one
+ICACHE_FLASH_ATTR
+static int httpserver_evictable(httpconn_t *conn)
+{
+    if (!conn->used || conn->exited || conn->phase != HTTP_PHASE_IDLE ||
+        conn->recv_data || conn->subscriber)
+        return 0;
+#ifdef HTTP_STACKLESS
+    return !conn->out_queue && !conn->writer && !conn->closing;
+#else
+    return !conn->websocket;
+#endif
+}
+
+// Close an idle keep-alive connection so a queued one gets its slot.
+// Returns ERR_ABRT if its pcb was aborted.
+ICACHE_FLASH_ATTR
+static err_t httpserver_evict(httpconn_t *conn)
+{
+    LOG_DEBUG("httpserver: closing idle connection for a queued one\n");
+    conn->hs->stats.evictions++;
+#ifdef HTTP_STACKLESS
+    return httpserver_close(conn);
+#else
+    // Looks like the client went away, so the coroutine closes it itself
+    conn->eof = 1;
+    httpserver_run_client(conn);
+    return ERR_OK;
+#endif
+}
+
+// Evict the connection that has been idle the longest, if any
+ICACHE_FLASH_ATTR
+static void httpserver_evict_idle(httpserver_t *hs)
+{
+    httpconn_t *victim = NULL;
+    uint32_t now = system_get_time();
+
+    for (int i = 0; i < hs->maxconns; i++) {
+        httpconn_t *conn = &hs->conns[i];
+        if (httpserver_evictable(conn) &&
+            (!victim || now - conn->phase_since > now - victim->phase_since))
+            victim = conn;
+    }
+    if (victim)
+        httpserver_evict(victim);
+}
+
+ICACHE_FLASH_ATTR
+static err_t httpserver_poll(void *arg, struct tcp_pcb *tcpb)
+{
+    httpconn_t *conn = arg;
+    if (!conn || conn->exited)
+        return ERR_OK;
+
+    struct httpserver_stats *stats = &conn->hs->stats;
+    uint32_t elapsed = system_get_time() - conn->phase_since;
+
+    if (conn->subscriber == HTTP_SUBSCRIBER_STREAMING && conn->write_failed)
+        return httpserver_abort(conn);
+
+    if (httpserver_send_pending(conn) &&
+        system_get_time() - conn->send_progress > HTTP_SEND_TIMEOUT_MS * 1000) {
+        LOG_WARN("httpserver: send timeout\n");
+        stats->timeouts_send++;
+        return httpserver_abort(conn);
+    }
+
+#ifndef HTTP_STACKLESS
+    if (conn->websocket) {
+        uint32_t now = system_get_time();
+        if (conn->ws_ping_pending && now - conn->ws_ping_since > HTTP_WS_PONG_TIMEOUT_MS * 1000) {
+            LOG_WARN("httpserver: websocket ping timeout\n");
+            stats->ws_ping_timeouts++;
+            return httpserver_abort(conn);
+        }
+        // The handler sends the ping itself, so it cannot end up in the
+        // middle of one of its frames
+        if (!conn->ws_ping_pending && now - conn->ws_last_rx > HTTP_WS_PING_INTERVAL_MS * 1000)
+            httpserver_run_client(conn);
+        return ERR_OK;
+    }
+#endif
+
+    switch (conn->phase) {
+    case HTTP_PHASE_REQUEST_LINE:
+        if (elapsed <= HTTP_REQUEST_LINE_TIMEOUT_MS * 1000)
+            break;
+        LOG_WARN("httpserver: request line timeout\n");
+        stats->timeouts_request_line++;
+        return httpserver_abort(conn);
+    case HTTP_PHASE_HEADERS:
+        if (elapsed <= HTTP_HEADERS_TIMEOUT_MS * 1000)
+            break;
+        LOG_WARN("httpserver: headers timeout\n");
+        stats->timeouts_headers++;
+        return httpserver_abort(conn);
+    case HTTP_PHASE_IDLE:
+        // Went idle after a queued connection arrived
+        if (conn->hs->stats.queue_depth && httpserver_evictable(conn))
+            return httpserver_evict(conn);
+        if (elapsed <= HTTP_KEEPALIVE_TIMEOUT_MS * 1000)
+            break;
+        stats->timeouts_idle++;
+        return httpserver_abort(conn);
+    case HTTP_PHASE_BODY:
+        if (elapsed <= HTTP_BODY_TIMEOUT_MS * 1000)
+            break;
+        LOG_WARN("httpserver: body timeout\n");
+        stats->timeouts_body++;
+        return httpserver_abort(conn);
+    }
+    return ERR_OK;
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_err(void *arg, err_t err)
+{
+    httpconn_t *conn = arg;
+    LOG_WARN("httpserver_err: error %d\n", err);
+    if (conn) {
+#ifdef HTTP_STACKLESS
+        httpserver_free_out(conn);
+#else
+        contwait_cancel(&conn->wait);
+        httpserver_note_stack(conn);
+        // The client will never run again
+        cont_release(&conn->cont);
+#endif
+        httpserver_record_close(conn);
+        trace(TRACE_CLOSE, httpserver_slot(conn), 2, 0);
+        httpserver_free_recv(conn);
+        conn->exited = 1;
+        conn->used = 0;
+        httpserver_accept_pending(conn->hs);
+    }
+}
+
+// Hand a connection to a free slot. recv_data and eof carry over anything
+// received while it was queued.
+ICACHE_FLASH_ATTR
+static void httpserver_attach(httpserver_t *hs, httpconn_t *conn, struct tcp_pcb *tcpb,
+                              struct pbuf *recv_data, int eof, uint32_t accepted_at)
+{
+#ifndef HTTP_STACKLESS
+    uint32_t stack_max = conn->stack_max;
+#endif
+
+    memset(conn, 0, sizeof(*conn));
+#ifndef HTTP_STACKLESS
+    conn->stack_max = stack_max;
+#endif
+    conn->used = 1;
+    conn->hs = hs;
+    conn->tcpb = tcpb;
+    conn->recv_data = recv_data;
+    conn->eof = eof;
+    conn->accepted_at = accepted_at;
+    httpserver_set_phase(conn, HTTP_PHASE_REQUEST_LINE);
     tcp_arg(tcpb, conn);
     tcp_recv(tcpb, httpserver_recv);
     tcp_sent(tcpb, httpserver_sent);
     tcp_err(tcpb, httpserver_err);
+    tcp_poll(tcpb, httpserver_poll, HTTP_POLL_INTERVAL);
+#ifdef HTTP_STACKLESS
+    httpserver_parser_reset(conn);
+    if (recv_data || eof)
+        httpserver_process(conn);
+#else
     cont_init(&conn->cont);
+    contwait_init(&conn->wait, &conn->cont, httpserver_wake, conn);
     httpserver_run_client(conn);
+#endif
+}
+
+ICACHE_FLASH_ATTR
+static httpconn_t *httpserver_free_slot(httpserver_t *hs)
+{
+    for (int i = 0; i < hs->maxconns; i++) {
+        if (!hs->conns[i].used)
+            return &hs->conns[i];
+    }
+    return NULL;
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_pending_remove(struct httppending *pc)
+{
+    pc->tcpb = NULL;
+    pc->recv_data = NULL;
+    pc->hs->stats.queue_depth--;
+}
+
+// Queued connections are not read from yet: data is held without opening
+// the window, so a client cannot make us buffer more than one window
+ICACHE_FLASH_ATTR
+static err_t httpserver_pending_recv(void *arg, struct tcp_pcb *tcpb, struct pbuf *p, err_t err)
+{
+    struct httppending *pc = arg;
 
+    if (!pc)
+        return ERR_OK;
+    if (!p) {
+        pc->eof = 1;
+        return ERR_OK;
+    }
+    if (pc->hs->queued_bytes + p->tot_len > HTTP_QUEUE_BUDGET)
+        return ERR_MEM;
+    if (pc->recv_data) {
+        if (pc->recv_data->tot_len + p->tot_len > HTTP_RECV_QUEUE_MAX)
+            return ERR_MEM;
+        pbuf_cat(pc->recv_data, p);
+    } else {
+        pc->recv_data = p;
+    }
+    pc->hs->queued_bytes += p->tot_len;
+    pc->hs->stats.bytes_in += p->tot_len;
     return ERR_OK;
 }
 
 ICACHE_FLASH_ATTR
-int httpserver_route(httpserver_t *hs, const char *path, http_handler_t handler)
+static void httpserver_pending_err(void *arg, err_t err)
+{
+    struct httppending *pc = arg;
+
+    LOG_WARN("httpserver_pending_err: error %d\n", err);
+    if (pc) {
+        if (pc->recv_data) {
+            pc->hs->queued_bytes -= pc->recv_data->tot_len;
+            pbuf_free(pc->recv_data);
+        }
+        httpserver_pending_remove(pc);
+    }
+}
+
+ICACHE_FLASH_ATTR
+static err_t httpserver_pending_poll(void *arg, struct tcp_pcb *tcpb)
+{
+    struct httppending *pc = arg;
+
+    if (!pc || system_get_time() - pc->since <= HTTP_QUEUE_TIMEOUT_MS * 1000)
+        return ERR_OK;
+    LOG_WARN("httpserver: accept queue timeout\n");
+    pc->hs->stats.timeouts_queue++;
+    if (pc->recv_data) {
+        pc->hs->queued_bytes -= pc->recv_data->tot_len;
+        pbuf_free(pc->recv_data);
+    }
+    httpserver_pending_remove(pc);
+    tcp_arg(tcpb, NULL);
+    tcp_abort(tcpb);
+    return ERR_ABRT;
+}
+
+// Move the longest waiting queued connections into free slots
+ICACHE_FLASH_ATTR
+static void httpserver_accept_pending(httpserver_t *hs)
+{
+    httpconn_t *conn;
+
+    while (hs->stats.queue_depth && (conn = httpserver_free_slot(hs))) {
+        struct httppending *pc = NULL;
+        uint32_t now = system_get_time();
+
+        for (int i = 0; i < HTTP_ACCEPT_QUEUE_MAX; i++) {
+            if (hs->pending[i].tcpb &&
+                (!pc || now - hs->pending[i].since > now - pc->since))
+                pc = &hs->pending[i];
+        }
+
+        uint32_t wait = now - pc->since;
+        hs->stats.queue_wait_us += wait;
+        if (wait > hs->stats.queue_wait_max_us)
+            hs->stats.queue_wait_max_us = wait;
+
+        struct tcp_pcb *tcpb = pc->tcpb;
+        struct pbuf *recv_data = pc->recv_data;
+        int eof = pc->eof;
+        uint32_t since = pc->since;
+        httpserver_pending_remove(pc);
+        httpserver_attach(hs, conn, tcpb, recv_data, eof, since);
+    }
+}
+
+ICACHE_FLASH_ATTR
+static err_t httpserver_accept(void *arg, struct tcp_pcb *tcpb, err_t err)
+{
+    httpserver_t *hs = arg;
+    httpconn_t *conn = httpserver_free_slot(hs);
+
+//     os_printf("accept\n");
+    hs->stats.accepts++;
+
+    if (conn) {
+        trace(TRACE_ACCEPT, conn - hs->conns, 0, hs->stats.queue_depth);
+        httpserver_attach(hs, conn, tcpb, NULL, 0, system_get_time());
+        return ERR_OK;
+    }
+
+    for (int i = 0; i < HTTP_ACCEPT_QUEUE_MAX; i++) {
+        struct httppending *pc = &hs->pending[i];
+
+        if (pc->tcpb)
+            continue;
+
+        pc->hs = hs;
+        pc->tcpb = tcpb;
+        pc->recv_data = NULL;
+        pc->eof = 0;
+        pc->since = system_get_time();
+        hs->stats.queued++;
+        hs->stats.queue_depth++;
+        trace(TRACE_ACCEPT, TRACE_NO_SLOT, 1, hs->stats.queue_depth);
+        tcp_arg(tcpb, pc);
+        tcp_recv(tcpb, httpserver_pending_recv);
+        tcp_err(tcpb, httpserver_pending_err);
+        tcp_poll(tcpb, httpserver_pending_poll, HTTP_POLL_INTERVAL);
+        httpserver_evict_idle(hs);
+        return ERR_OK;
+    }
+
+    LOG_WARN("httpserver: too many connections\n");
+    hs->stats.rejects++;
+    return ERR_MEM;
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_set_routes(httpserver_t *hs, const struct httproute *routes, int count)
 {
-    if (hs->handler_count >= HTTP_MAX_HANDLERS)
+    uint32_t size = 4;
+
+    // Keep the index at most half full so probe sequences stay short
+    while (size < 2 * count)
+        size <<= 1;
+
+    struct httproute_slot *index = os_malloc(size * sizeof(*index));
+    if (!index) {
+        LOG_ERROR("Alloc route index failed\n");
         return -1;
+    }
+    memset(index, 0, size * sizeof(*index));
+
+    for (int i = 0; i < count; i++) {
+        const char *path = routes[i].path;
+        size_t len = strlen(path);
+        int prefix = len && path[len - 1] == '*';
+
+        if (prefix)
+            len--;
+        uint32_t hash = httpserver_hash(path, len);
+        uint32_t j = hash & (size - 1);
+        while (index[j].route)
+            j = (j + 1) & (size - 1);
+        index[j].hash = hash;
+        index[j].route = i + 1;
+        index[j].prefix = prefix;
+    }
+
+    // Counting is optional, the routes work without it
+    uint32_t *requests = os_malloc(count * sizeof(*requests));
+    if (requests)
+        memset(requests, 0, count * sizeof(*requests));
+
+    if (hs->route_index)
+        os_free(hs->route_index);
+    if (hs->route_requests)
+        os_free(hs->route_requests);
+    hs->routes = routes;
+    hs->route_count = count;
+    hs->route_index = index;
+    hs->route_mask = size - 1;
+    hs->route_requests = requests;
+    return 0;
+}
 
-    hs->handlers[hs->handler_count].path = path;
-    hs->handlers[hs->handler_count].func = handler;
-    hs->handler_count++;
+ICACHE_FLASH_ATTR
+const struct httpserver_stats *httpserver_get_stats(httpserver_t *hs)
+{
+    hs->stats.subscribers = 0;
+    for (int i = 0; i < hs->maxconns; i++) {
+        if (hs->conns[i].used && hs->conns[i].subscriber == HTTP_SUBSCRIBER_STREAMING)
+            hs->stats.subscribers++;
+    }
+#ifndef HTTP_STACKLESS
+    hs->stats.websockets = 0;
+    for (int i = 0; i < hs->maxconns; i++) {
+        if (hs->conns[i].used && hs->conns[i].websocket)
+            hs->stats.websockets++;
+    }
+#endif
+    hs->stats.queued_bytes = hs->queued_bytes;
+    return &hs->stats;
+}
+
+ICACHE_FLASH_ATTR
+static void httpserver_write_metric(httpconn_t *conn, const char *name, const char *labels,
+                                    uint32_t value)
+{
+    httpserver_printf(conn, "%s%s %u\n", name, labels ? labels : "", value);
+}
+
+// Microsecond counters as seconds, without floating point formatting
+ICACHE_FLASH_ATTR
+static void httpserver_write_metric_us(httpconn_t *conn, const char *name, uint32_t us)
+{
+    httpserver_printf(conn, "%s %u.%06u\n", name, us / 1000000, us % 1000000);
+}
+
+ICACHE_FLASH_ATTR
+int httpserver_write_histogram(httpconn_t *conn, const char *name, const struct histogram *h)
+{
+    uint32_t count = 0;
+
+    // Prometheus buckets are cumulative
+    for (int k = 0; k < HISTOGRAM_BUCKETS - 1; k++) {
+        uint32_t le = histogram_bound(k);
+
+        count += h->buckets[k];
+        httpserver_printf(conn, "%s_bucket{le=\"%u.%06u\"} %u\n",
+                          name, le / 1000000, le % 1000000, count);
+    }
+    httpserver_printf(conn, "%s_bucket{le=\"+Inf\"} %u\n", name, h->count);
+    httpserver_printf(conn, "%s_sum %u.%06u\n", name,
+                      (uint32_t)(h->sum_us / 1000000), (uint32_t)(h->sum_us % 1000000));
+    httpserver_printf(conn, "%s_count %u\n", name, h->count);
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+uint32_t httpserver_write_metrics(httpconn_t *conn, uint32_t step)
+{
+    httpserver_t *hs = conn->hs;
+    const struct httpserver_stats *stats = httpserver_get_stats(hs);
+
+    switch (step) {
+    case 0:
+        httpserver_write_metric(conn, "http_accepts_total", NULL, stats->accepts);
+        httpserver_write_metric(conn, "http_rejects_total", NULL, stats->rejects);
+        httpserver_write_metric(conn, "http_responses_total", NULL, stats->responses);
+        for (int i = 0; i < hs->route_count && hs->route_requests; i++) {
+            httpserver_printf(conn, "http_requests_total{route=\"%s\"} %u\n",
+                              hs->routes[i].path, hs->route_requests[i]);
+        }
+        httpserver_write_metric(conn, "http_requests_unrouted_total", NULL, stats->unrouted);
+        httpserver_write_metric(conn, "http_received_bytes_total", NULL, stats->bytes_in);
+        httpserver_write_metric(conn, "http_sent_bytes_total", NULL, stats->bytes_out);
+        httpserver_write_metric(conn, "http_response_writes_total", NULL, stats->writes);
+        httpserver_write_metric(conn, "http_write_retries_total", NULL, stats->write_retries);
+        httpserver_write_metric(conn, "http_recv_copied_bytes_total", NULL, stats->recv_copied);
+        return 1;
+    case 1:
+        httpserver_write_metric(conn, "http_accept_queued_total", NULL, stats->queued);
+        httpserver_write_metric(conn, "http_accept_queue_depth", NULL, stats->queue_depth);
+        httpserver_write_metric(conn, "http_queued_bytes", NULL, stats->queued_bytes);
+        httpserver_write_metric(conn, "http_queue_budget_bytes", NULL, HTTP_QUEUE_BUDGET);
+        httpserver_write_metric_us(conn, "http_accept_queue_wait_seconds_total", stats->queue_wait_us);
+        httpserver_write_metric_us(conn, "http_accept_queue_wait_seconds_max", stats->queue_wait_max_us);
+        httpserver_write_metric(conn, "http_timeouts_total", "{phase=\"request_line\"}",
+                                stats->timeouts_request_line);
+        httpserver_write_metric(conn, "http_timeouts_total", "{phase=\"headers\"}",
+                                stats->timeouts_headers);
+        httpserver_write_metric(conn, "http_timeouts_total", "{phase=\"idle\"}",
+                                stats->timeouts_idle);
+        httpserver_write_metric(conn, "http_timeouts_total", "{phase=\"body\"}",
+                                stats->timeouts_body);
+        httpserver_write_metric(conn, "http_timeouts_total", "{phase=\"send\"}",
+                                stats->timeouts_send);
+        httpserver_write_metric(conn, "http_timeouts_total", "{phase=\"queue\"}",
+                                stats->timeouts_queue);
+        httpserver_write_metric(conn, "http_idle_evictions_total", NULL, stats->evictions);
+        httpserver_write_metric(conn, "http_not_modified_total", NULL, stats->not_modified);
+        httpserver_write_metric(conn, "http_event_subscribers", NULL, stats->subscribers);
+        httpserver_write_metric(conn, "http_events_sent_total", NULL, stats->events_sent);
+        httpserver_write_metric(conn, "http_events_dropped_total", NULL, stats->events_dropped);
+        return 2;
+    case 2:
+        httpserver_write_histogram(conn, "http_request_duration_seconds", &stats->request_us);
+        return 3;
+    case 3:
+        httpserver_write_histogram(conn, "http_handler_duration_seconds", &stats->handler_us);
+        return 4;
+    case 4:
+        httpserver_write_histogram(conn, "http_connection_duration_seconds", &stats->connection_us);
+        return 5;
+#ifndef HTTP_STACKLESS
+    case 5:
+        httpserver_write_metric(conn, "http_yields_total", NULL, stats->yields);
+        httpserver_write_metric(conn, "http_websockets", NULL, stats->websockets);
+        httpserver_write_metric(conn, "http_websocket_messages_total", "{direction=\"in\"}",
+                                stats->ws_messages_in);
+        httpserver_write_metric(conn, "http_websocket_messages_total", "{direction=\"out\"}",
+                                stats->ws_messages_out);
+        httpserver_write_metric(conn, "http_websocket_ping_timeouts_total", NULL,
+                                stats->ws_ping_timeouts);
+
+        httpserver_write_metric(conn, "http_stack_size_bytes", NULL, CONT_STACKSIZE);
+        for (int i = 0; i < hs->maxconns; i++) {
+            if (hs->conns[i].used)
+                httpserver_note_stack(&hs->conns[i]);
+            httpserver_printf(conn, "http_stack_used_max_bytes{slot=\"%d\"} %u\n",
+                              i, hs->conns[i].stack_max);
+        }
+        return HTTP_WRITER_DONE;
+#endif
+    }
+    return HTTP_WRITER_DONE;
 }
 
 ICACHE_FLASH_ATTR
@@ -366,26 +3092,30 @@ httpserver_t * httpserver_init(int port, int maxconns)
     httpserver_t *hs = os_malloc(sizeof(httpserver_t));
     memset(hs, 0, sizeof(*hs));
 
-    os_printf("httpserver_init\n");
+    LOG_INFO("httpserver_init\n");
     if (!hs) {
-        os_printf("Alloc httpserver_t failed\n");
+        LOG_ERROR("Alloc httpserver_t failed\n");
         return NULL;
     }
     hs->listener = tcp_new();
     if (!hs->listener) {
-        os_printf("Alloc httpserver_t failed\n");
+        LOG_ERROR("Alloc httpserver_t failed\n");
     }
     hs->port = port;
     hs->maxconns = maxconns;
     hs->conns = os_malloc(sizeof(httpconn_t) * maxconns);
     memset(hs->conns, 0, sizeof(httpconn_t) * maxconns);
     if (!hs->conns) {
-        os_printf("Alloc %d x httpconn_t failed\n", maxconns);
+        LOG_ERROR("Alloc %d x httpconn_t failed\n", maxconns);
         return NULL;
     }
     if (tcp_bind(hs->listener, IP_ADDR_ANY, hs->port) != ERR_OK) {
-        os_printf("tcp_bind failed\n");
+        LOG_ERROR("tcp_bind failed\n");
     }
+    // The SDK allows 5 TCP PCBs unless told otherwise, fewer than the
+    // slots and accept queue need
+    if (espconn_tcp_set_max_con(maxconns + HTTP_ACCEPT_QUEUE_MAX) != 0)
+        LOG_WARN("httpserver: could not raise the TCP connection limit\n");
     return hs;
 }
 
@@ -394,12 +3124,12 @@ int httpserver_start(httpserver_t *hs)
 {
     struct tcp_pcb *p = tcp_listen(hs->listener);
     if (!p) {
-        os_printf("tcp_listen failed\n");
+        LOG_ERROR("tcp_listen failed\n");
         return -1;
     }
     hs->listener = p;
     tcp_arg(hs->listener, hs);
     tcp_accept(hs->listener, httpserver_accept);
-    os_printf("httpserver_start\n");
+    LOG_INFO("httpserver_start\n");
     return 0;
 }
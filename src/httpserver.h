@@ -1,3 +1,7 @@
+#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+#include "histogram.h"
 
 struct httpserver;
 typedef struct httpserver httpserver_t;
@@ -5,17 +9,197 @@ typedef struct httpserver httpserver_t;
 struct httpconn;
 typedef struct httpconn httpconn_t;
 
+struct httpserver_stats {
+    // Connections accepted, and refused because the queue was full too
+    uint32_t accepts;
+    uint32_t rejects;
+    uint32_t responses;
+    // Requests that matched no route (404, 405, unknown methods); those
+    // that did are counted per route
+    uint32_t unrouted;
+    // Payload bytes received and handed to tcp_write()
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    // Coroutine engine: times a connection yielded waiting for data or
+    // send buffer space
+    uint32_t yields;
+    // tcp_write() calls that hit ERR_MEM (or a full send buffer) and had
+    // to wait or queue
+    uint32_t write_retries;
+    // Successful tcp_write() calls for responses, in either engine. lwIP
+    // merges them into MSS-sized segments until the next tcp_output(), so
+    // this is not a segment count.
+    uint32_t writes;
+    // Request bytes copied out of received pbufs
+    uint32_t recv_copied;
+    // Connections that had to wait for a free slot, how many are waiting
+    // right now, and their total and longest wait
+    uint32_t queued;
+    uint32_t queue_depth;
+    uint32_t queue_wait_us;
+    uint32_t queue_wait_max_us;
+    // Received data held and stackless response data queued right now,
+    // across all connections
+    uint32_t queued_bytes;
+    // Connections dropped for taking too long to send the request line,
+    // the headers or the body, for idling between keep-alive requests, for
+    // not acknowledging our output, or for waiting too long in the queue
+    uint32_t timeouts_request_line;
+    uint32_t timeouts_headers;
+    uint32_t timeouts_idle;
+    uint32_t timeouts_body;
+    uint32_t timeouts_send;
+    uint32_t timeouts_queue;
+    // Idle keep-alive connections closed to make room for queued ones
+    uint32_t evictions;
+    // Conditional requests answered with 304
+    uint32_t not_modified;
+    // Event stream subscribers, and broadcasts sent to or dropped for them
+    uint32_t subscribers;
+    uint32_t events_sent;
+    uint32_t events_dropped;
+    // Open WebSocket connections, messages received and sent on them, and
+    // connections dropped for not answering a ping
+    uint32_t websockets;
+    uint32_t ws_messages_in;
+    uint32_t ws_messages_out;
+    uint32_t ws_ping_timeouts;
+    // From the first byte of a request (or from when the server gets to
+    // it, if it was already queued) until its response is out; from
+    // handler start until then; from accept until close
+    struct histogram request_us;
+    struct histogram handler_us;
+    struct histogram connection_us;
+};
+
+// Stackless connections only cost their parser state, coroutine ones
+// carry a whole stack each. Buffered data is bounded server-wide (see
+// HTTP_QUEUE_BUDGET), not per slot.
+#ifdef HTTP_STACKLESS
+#define HTTP_DEFAULT_MAXCONNS 8
+#elif defined(CONT_SHARED_STACK)
+#define HTTP_DEFAULT_MAXCONNS 4
+#else
+#define HTTP_DEFAULT_MAXCONNS 2
+#endif
+
 httpserver_t *httpserver_init(int port, int maxconns);
+const struct httpserver_stats *httpserver_get_stats(httpserver_t *hs);
+
+#define HTTP_METHOD_GET 1
+#define HTTP_METHOD_HEAD 2
+#define HTTP_METHOD_POST 4
+#define HTTP_METHOD_PUT 8
 
 typedef void (*http_handler_t)(httpconn_t *conn, char *path, char *query_string);
-int httpserver_route(httpserver_t *hs, const char *path, http_handler_t handler);
+
+// A route matches its path exactly, or every path starting with it if it
+// ends in '*' ("/ir/*"). The same path may appear several times with
+// different methods; GET routes also handle HEAD. Tables can live in flash
+// (ICACHE_RODATA_ATTR), so every field is a full word; the path strings
+// themselves must be in RAM.
+struct httproute {
+    const char *path;
+    uint32_t methods;
+    http_handler_t handler;
+};
+
+// Routes are looked up through a hash index built here, the table itself
+// is used in place and must stay valid
+int httpserver_set_routes(httpserver_t *hs, const struct httproute *routes, int count);
 
 int httpserver_read_header(httpconn_t *conn, char **header, char **value);
+// Whether the client accepts gzip Content-Encoding. Only valid once the
+// request headers have been read (e.g. after httpserver_end_request()).
+int httpserver_accepts_gzip(httpconn_t *conn);
 int httpserver_end_request(httpconn_t *conn);
+int httpserver_get_method(httpconn_t *conn);
+// Read up to size bytes of the request body (Content-Length delimited,
+// chunked bodies are refused). Returns the number of bytes read, 0 at the
+// end of the body or -1 on error. Whatever is left unread is discarded.
+// In the stackless engine the body is limited to HTTP_RECV_QUEUE_MAX, the
+// coroutine engine streams it and waits for more data as needed.
+int httpserver_read_body(httpconn_t *conn, void *buf, size_t size);
+// Handle a conditional GET: if the client's copy matches the etag (a quoted
+// string, optionally W/ prefixed) or was modified no earlier than
+// last_modified (Unix time, 0 if unknown), send a 304 and return 1; the
+// handler is then done. Otherwise the validators are sent with the response
+// headers; etag must stay valid until httpserver_end_headers().
+int httpserver_conditional(httpconn_t *conn, const char *etag, uint32_t last_modified);
 int httpserver_start_response(httpconn_t *conn, int code, const char *text);
 int httpserver_send_header(httpconn_t *conn, const char *header, const char *value);
+int httpserver_send_content_length(httpconn_t *conn, size_t length);
+// Without a Content-Length header, HTTP/1.1 responses are sent with chunked
+// encoding (each flush of the staging buffer becomes one chunk), so the
+// connection can be kept alive
 int httpserver_end_headers(httpconn_t *conn);
 int httpserver_write_data(httpconn_t *conn, const void *data, size_t length);
 int httpserver_write_string(httpconn_t *conn, const char *data);
+// Format straight into the staging buffer (libs/printf.h syntax, floats
+// included). Returns the number of bytes written.
+int httpserver_printf(httpconn_t *conn, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+// Write data that stays valid and unchanged forever (string literals,
+// ICACHE_RODATA_ATTR tables) without copying it into lwIP buffers
+int httpserver_write_static(httpconn_t *conn, const void *data, size_t length);
+// Push out staged writes without waiting for a full segment
+int httpserver_flush(httpconn_t *conn);
+
+// A body writer is called with step 0 first; each call writes the next
+// piece of the body (about a segment at most) and returns the step to call
+// it with next, or HTTP_WRITER_DONE
+#define HTTP_WRITER_DONE 0xffffffff
+typedef uint32_t (*http_writer_t)(httpconn_t *conn, uint32_t step);
+// Write the rest of the body with fn; the handler must return right after,
+// without writing anything else. The coroutine engine runs all steps at
+// once. The stackless one runs them as the client acknowledges data, from
+// the sent callback, so only a step's worth of output is ever queued; fn
+// must then not depend on anything on the handler's stack.
+int httpserver_write_steps(httpconn_t *conn, http_writer_t fn);
+
+// Body writer for the server's own counters in Prometheus text format,
+// including per-route request counts and (coroutine engine) the stack
+// high-water mark of each connection slot
+uint32_t httpserver_write_metrics(httpconn_t *conn, uint32_t step);
+// Write a histogram of microsecond durations as a Prometheus histogram
+// in seconds
+int httpserver_write_histogram(httpconn_t *conn, const char *name, const struct histogram *h);
+
+void httpserver_handle_404(httpconn_t *conn, const char *path, char *query_string);
+
+// Keep the connection open after the handler returns, to receive
+// httpserver_broadcast() data (e.g. a text/event-stream). Call before
+// httpserver_end_headers(). Fails if all but one slot are subscribed.
+int httpserver_subscribe(httpconn_t *conn);
+// Send data to every subscriber; subscribers that have not caught up with
+// earlier data miss it
+void httpserver_broadcast(httpserver_t *hs, const void *data, size_t length);
+
+#define HTTP_WS_TEXT 1
+#define HTTP_WS_BINARY 2
+
+// httpserver_ws_read() results other than a message length
+#define HTTP_WS_CLOSED -1
+#define HTTP_WS_WOKEN -2
+
+// Complete a WebSocket handshake (RFC 6455). Returns 0 once the connection
+// is upgraded; the handler then keeps it by not returning, and the
+// connection is closed when it does. Otherwise an error response has been
+// sent and -1 is returned. Needs the coroutine engine; the stackless one
+// answers 501. Like subscribers, WebSockets always leave a slot free.
+int httpserver_ws_accept(httpconn_t *conn);
+// Wait for the next text or binary message and read it into buf, setting
+// *opcode. Longer messages are truncated. Pings are answered and the
+// client pinged when idle meanwhile. Returns the length, HTTP_WS_CLOSED
+// once the connection is closing, or HTTP_WS_WOKEN after
+// httpserver_ws_wake_all().
+int httpserver_ws_read(httpconn_t *conn, void *buf, size_t size, int *opcode);
+// Send a message in a single frame. Returns 0, or -1 if the connection is
+// closing.
+int httpserver_ws_send(httpconn_t *conn, int opcode, const void *data, size_t length);
+// Make every WebSocket handler waiting in httpserver_ws_read() return
+// HTTP_WS_WOKEN, e.g. so it can push new data. Does not block.
+void httpserver_ws_wake_all(httpserver_t *hs);
 
 int httpserver_start(httpserver_t *hs);
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdarg.h>
+
+#include "ets_sys.h"
+#include "osapi.h"
+
+#include "printf.h"
+#include "log.h"
+
+// Must be a power of two
+#ifndef LOG_BUF_SIZE
+#define LOG_BUF_SIZE 1024
+#endif
+
+// Longest message; longer ones are cut short
+#define LOG_LINE_SIZE 128
+
+// UART0 registers, as in the SDK's driver_lib uart_register.h
+#define LOG_UART_FIFO 0x60000000
+#define LOG_UART_INT_ST 0x60000008
+#define LOG_UART_INT_ENA 0x6000000c
+#define LOG_UART_INT_CLR 0x60000010
+#define LOG_UART_STATUS 0x6000001c
+#define LOG_UART_CONF1 0x60000024
+#define LOG_UART_TXFIFO_EMPTY_INT BIT1
+#define LOG_UART_TXFIFO_CNT(status) (((status) >> 16) & 0xff)
+#define LOG_UART_TXFIFO_EMPTY_THRHD_S 8
+#define LOG_UART_TXFIFO_EMPTY_THRHD_M 0x7f
+#define LOG_UART_FIFO_SIZE 128
+
+// The interrupt fires once the FIFO runs below this many bytes
+#define LOG_UART_TX_THRESHOLD 16
+
+#if LOG_BUF_SIZE & (LOG_BUF_SIZE - 1)
+#error LOG_BUF_SIZE must be a power of two
+#endif
+
+static char ring[LOG_BUF_SIZE];
+// Free running; the writer only moves head, the interrupt only tail
+static volatile uint32_t ring_head, ring_tail;
+static uint32_t dropped;
+static int putc_dropping;
+
+// Runs from the interrupt, so it stays in IRAM, as does everything it calls
+static void log_fill(void)
+{
+    uint32_t room = LOG_UART_FIFO_SIZE - LOG_UART_TXFIFO_CNT(READ_PERI_REG(LOG_UART_STATUS));
+    uint32_t tail = ring_tail;
+
+    while (room-- && tail != ring_head)
+        WRITE_PERI_REG(LOG_UART_FIFO, ring[tail++ & (LOG_BUF_SIZE - 1)]);
+    ring_tail = tail;
+    if (tail == ring_head)
+        CLEAR_PERI_REG_MASK(LOG_UART_INT_ENA, LOG_UART_TXFIFO_EMPTY_INT);
+}
+
+static void log_isr(void *arg)
+{
+    uint32_t status = READ_PERI_REG(LOG_UART_INT_ST);
+
+    if (status & LOG_UART_TXFIFO_EMPTY_INT)
+        log_fill();
+    WRITE_PERI_REG(LOG_UART_INT_CLR, status);
+}
+
+// Copy len bytes into the ring, with '\n' expanded to "\r\n". All or
+// nothing; returns 0 if it did not fit.
+static int log_write(const char *s, size_t len)
+{
+    size_t need = len;
+
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\n')
+            need++;
+    }
+    uint32_t head = ring_head;
+    if (need > LOG_BUF_SIZE - (head - ring_tail))
+        return 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\n')
+            ring[head++ & (LOG_BUF_SIZE - 1)] = '\r';
+        ring[head++ & (LOG_BUF_SIZE - 1)] = s[i];
+    }
+    ring_head = head;
+    // The interrupt stays enabled until the ring is empty again
+    SET_PERI_REG_MASK(LOG_UART_INT_ENA, LOG_UART_TXFIFO_EMPTY_INT);
+    return 1;
+}
+
+// os_printf() output from the SDK and vendored code, one byte at a time;
+// each run of lost bytes counts as one dropped message
+static void log_putc(char c)
+{
+    if (log_write(&c, 1)) {
+        putc_dropping = 0;
+    } else if (!putc_dropping) {
+        putc_dropping = 1;
+        dropped++;
+    }
+}
+
+ICACHE_FLASH_ATTR
+void log_printf(const char *fmt, ...)
+{
+    char buf[LOG_LINE_SIZE];
+    va_list va;
+
+    va_start(va, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, va);
+    va_end(va);
+
+    if (len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+        buf[len - 1] = '\n';
+    }
+    if (!log_write(buf, len))
+        dropped++;
+}
+
+ICACHE_FLASH_ATTR
+uint32_t log_dropped(void)
+{
+    return dropped;
+}
+
+ICACHE_FLASH_ATTR
+void log_init(void)
+{
+    ETS_UART_INTR_DISABLE();
+    CLEAR_PERI_REG_MASK(LOG_UART_CONF1, LOG_UART_TXFIFO_EMPTY_THRHD_M << LOG_UART_TXFIFO_EMPTY_THRHD_S);
+    SET_PERI_REG_MASK(LOG_UART_CONF1, LOG_UART_TX_THRESHOLD << LOG_UART_TXFIFO_EMPTY_THRHD_S);
+    WRITE_PERI_REG(LOG_UART_INT_CLR, 0xffff);
+    ETS_UART_INTR_ATTACH(log_isr, NULL);
+    ETS_UART_INTR_ENABLE();
+    os_install_putc1(log_putc);
+}
@@ -0,0 +1,49 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "c_types.h"
+
+// Leveled logging. Messages above LOG_LEVEL are compiled out, arguments
+// included; the rest are formatted into a RAM ring buffer that the UART0
+// TX interrupt drains, so logging never waits for the serial port. When
+// the buffer is full, whole messages are dropped and counted.
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Takes over UART0 output, including os_printf() from the SDK and libs/
+void log_init(void);
+void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+uint32_t log_dropped(void);
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) log_printf(__VA_ARGS__)
+#else
+#define LOG_ERROR(...) do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) log_printf(__VA_ARGS__)
+#else
+#define LOG_WARN(...) do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) log_printf(__VA_ARGS__)
+#else
+#define LOG_INFO(...) do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) log_printf(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while (0)
+#endif
+
+#endif
@@ -5,26 +5,23 @@
 #include "os_type.h"
 #include "ip_addr.h"
 #include "user_interface.h"
+#include "mem.h"
+#include "sntp.h"
 
 #include "httpserver.h"
 #include "printf.h"
-#include "bme280.h"
 #include "i2c_master.h"
+#include "sensors.h"
+#include "assets.h"
+#include "trace.h"
+#include "log.h"
 
 httpserver_t *hs;
 
-#define MAX_SENSORS 2
-
 #define PIN_SDA 0
 #define PIN_SCL 2
 #define PIN_IR 3
 
-int bme_present[MAX_SENSORS] = { 0 };
-struct bme280_dev bme[MAX_SENSORS];
-const int addresses[MAX_SENSORS] = {
-  0x76, 0x77
-};
-
 ICACHE_FLASH_ATTR
 uint32 user_rf_cal_sector_set(void)
 {
@@ -64,230 +61,356 @@ uint32 user_rf_cal_sector_set(void)
     return rf_cal_sec;
 }
 
-void user_delay_ms(uint32_t period)
+#ifndef CONFIG_NTP_SERVER
+#define CONFIG_NTP_SERVER "pool.ntp.org"
+#endif
+
+// Wall clock time of the newest sample, or 0 if SNTP has not synced yet
+ICACHE_FLASH_ATTR
+static uint32_t sample_time(void)
 {
-    os_delay_us(1000 * period);
+    uint32_t now = sntp_get_current_timestamp();
+    uint32_t age = 0xffffffff;
+
+    if (!now)
+        return 0;
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        if (bme_present[i] && sensors_sample_age_us(i) < age)
+            age = sensors_sample_age_us(i);
+    }
+    if (age == 0xffffffff)
+        return 0;
+    return now - age / 1000000;
 }
 
-int8_t user_i2c_read(uint8_t dev_id, uint8_t reg_addr, uint8_t *reg_data, uint16_t len)
+ICACHE_FLASH_ATTR
+void handle_status(httpconn_t *conn, char *path, char *query_string)
 {
-    i2c_master_start();
-    i2c_master_writeByte(dev_id << 1);
-    if (i2c_master_getAck()) {
-        i2c_master_stop();
-        return -1;
-    }
-    i2c_master_writeByte(reg_addr);
-    if (i2c_master_getAck()) {
-        i2c_master_stop();
-        return -1;
-    }
-    i2c_master_stop();
-    i2c_master_start();
-    i2c_master_writeByte((dev_id << 1) | 1);
-    if (i2c_master_getAck()) {
-        i2c_master_stop();
-        return -1;
-    }
+    char etag[16];
 
-    while (len--) {
-        *reg_data++ = i2c_master_readByte();
-        i2c_master_setAck(len == 0);
+    // Uptime and sample ages still advance between generations, but only
+    // as an approximation, hence a weak ETag
+    os_sprintf(etag, "W/\"g%d\"", sensors_generation());
+    if (httpserver_conditional(conn, etag, sample_time()))
+        return;
+
+    httpserver_start_response(conn, 200, "OK");
+    httpserver_send_header(conn, "Content-Type", "application/json");
+    httpserver_send_header(conn, "Cache-Control", "no-cache");
+    httpserver_end_headers(conn);
+    if (httpserver_get_method(conn) == HTTP_METHOD_HEAD)
+        return;
+
+    struct ip_info info;
+    wifi_get_ip_info(STATION_IF, &info);
+    uint8 mac[6];
+    wifi_get_macaddr(STATION_IF, mac);
+    httpserver_printf(conn,
+                      "{\"hostname\":\"%s\",\"ip\":\"%d.%d.%d.%d\","
+                      "\"mac\":\"%02x:%02x:%02x:%02x:%02x:%02x\",\"uptime\":%u,\"sensors\":[",
+                      wifi_station_get_hostname(), IP2STR(&info.ip),
+                      mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+                      system_get_time() / 1000000);
+
+    int first = 1;
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        if (!bme_present[i])
+            continue;
+
+        const struct sensor_sample *s = sensors_get_sample(i);
+
+        httpserver_printf(conn, "%s{\"id\":%d,\"status\":%d", first ? "" : ",", i, s->status);
+        first = 0;
+
+        // Values are from the last successful read
+        httpserver_printf(conn,
+                          ",\"temperature\":%.02f,\"pressure\":%.02f,\"humidity\":%.02f,"
+                          "\"age\":%.03f}",
+                          s->data.temperature, s->data.pressure, s->data.humidity,
+                          sensors_sample_age_us(i) / 1000000.0);
     }
 
-    i2c_master_stop();
-    return 0;
+    httpserver_write_string(conn, "]}\n");
 }
 
-int8_t user_i2c_write(uint8_t dev_id, uint8_t reg_addr, uint8_t *reg_data, uint16_t len)
+// The sensor part of /metrics only changes with the sample generation, so
+// it is rendered once per generation and the bytes reused for every scrape
+#define METRICS_CACHE_SIZE 1024
+
+static char *metrics_cache;
+static int metrics_cache_len;
+static uint32_t metrics_cache_gen;
+static uint32_t metrics_cache_hits;
+static uint32_t metrics_cache_misses;
+
+// Render the sensor readings into buf. Returns the length, or -1 if it
+// did not fit. With a conn, they are formatted straight into the response
+// instead and buf is unused.
+ICACHE_FLASH_ATTR
+static int render_sensor_metrics(httpconn_t *conn, char *buf, int size)
 {
-    i2c_master_start();
-    i2c_master_writeByte(dev_id << 1);
-    if (i2c_master_getAck()) {
-        i2c_master_stop();
-        return -1;
+    int len = 0;
+
+#define APPEND(...) do { \
+        if (conn) \
+            httpserver_printf(conn, __VA_ARGS__); \
+        else \
+            len += snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__); \
+    } while (0)
+
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        if (!bme_present[i])
+            continue;
+        APPEND("sensor_read_status{sensor=\"%d\"} %d\n",
+               i, sensors_get_sample(i)->status);
     }
-    i2c_master_writeByte(reg_addr);
-    if (i2c_master_getAck()) {
-        i2c_master_stop();
-        return -1;
+
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        if (bme_present[i] && sensors_get_sample(i)->status == SENSOR_OK) {
+            APPEND("sensor_temperature_celsius{sensor=\"%d\"} %.02f\n",
+                   i, sensors_get_sample(i)->data.temperature);
+        }
     }
 
-    while (len--) {
-        i2c_master_writeByte(*reg_data++);
-        if (i2c_master_getAck()) {
-            i2c_master_stop();
-            return -1;
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        if (bme_present[i] && sensors_get_sample(i)->status == SENSOR_OK) {
+            APPEND("sensor_pressure_pascals{sensor=\"%d\"} %.02f\n",
+                   i, sensors_get_sample(i)->data.pressure);
         }
     }
 
-    i2c_master_stop();
-    return 0;
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        if (bme_present[i] && sensors_get_sample(i)->status == SENSOR_OK) {
+            APPEND("sensor_humidity_relative{sensor=\"%d\"} %.05f\n",
+                   i, sensors_get_sample(i)->data.humidity / 100.0f);
+        }
+    }
+
+#undef APPEND
+
+    return len < size ? len : -1;
 }
 
+// Body writer for /metrics: the stackless engine resumes it from the sent
+// callback, so the response is never queued in full
 ICACHE_FLASH_ATTR
-void handle_root(httpconn_t *conn, char *path, char *query_string)
+static uint32_t write_metrics(httpconn_t *conn, uint32_t step)
 {
-    char lbuf[256];
-    int ret;
+    switch (step) {
+    case 0:
+        if (!metrics_cache)
+            metrics_cache = os_malloc(METRICS_CACHE_SIZE);
+
+        uint32_t gen = sensors_generation();
+        if (metrics_cache && metrics_cache_len > 0 && metrics_cache_gen == gen) {
+            metrics_cache_hits++;
+        } else if (metrics_cache) {
+            metrics_cache_misses++;
+            metrics_cache_len = render_sensor_metrics(NULL, metrics_cache, METRICS_CACHE_SIZE);
+            metrics_cache_gen = gen;
+            if (metrics_cache_len < 0)
+                LOG_WARN("metrics: cache too small\n");
+        }
 
+        if (metrics_cache && metrics_cache_len > 0) {
+            // Copied once into the send path; the cache may be rewritten by
+            // the next generation before lwIP is done with it
+            httpserver_write_data(conn, metrics_cache, metrics_cache_len);
+        } else {
+            // No memory or too much to cache, render straight into the response
+            render_sensor_metrics(conn, NULL, 0);
+        }
+        return 1;
+    case 1:
+        // Everything below changes on its own and is always rendered
+        for (int i = 0; i < MAX_SENSORS; i++) {
+            if (bme_present[i]) {
+                httpserver_printf(conn, "sensor_sample_age_seconds{sensor=\"%d\"} %.03f\n",
+                                  i, sensors_sample_age_us(i) / 1000000.0);
+            }
+        }
+
+        httpserver_printf(conn, "metrics_cache_hits_total %u\n", metrics_cache_hits);
+        httpserver_printf(conn, "metrics_cache_misses_total %u\n", metrics_cache_misses);
+        httpserver_printf(conn, "log_dropped_messages_total %u\n", log_dropped());
+        httpserver_write_histogram(conn, "sensor_read_duration_seconds", sensors_read_histogram());
+        return 2;
+    default:
+        // The server's own steps follow ours
+        step = httpserver_write_metrics(conn, step - 2);
+        return step == HTTP_WRITER_DONE ? step : step + 2;
+    }
+}
+
+ICACHE_FLASH_ATTR
+void handle_metrics(httpconn_t *conn, char *path, char *query_string)
+{
     httpserver_end_request(conn);
     httpserver_start_response(conn, 200, "OK");
-    httpserver_send_header(conn, "Content-Type", "text/html");
+    httpserver_send_header(conn, "Content-Type", "text/plain; version=0.0.4");
     httpserver_end_headers(conn);
+    if (httpserver_get_method(conn) == HTTP_METHOD_HEAD)
+        return;
 
-    httpserver_write_string(conn,
-"<!doctype html>\
-  <html><head>\
-    <meta http-equiv='refresh' content='30'>\
-    <title>ESP8266 Temperature Sensor</title>\
-  </head><body>\
-    <h1>ESP8266 temperature & IR remote server</h1>\
-    <h3>Status</h3>\
-    <p>");
+    httpserver_write_steps(conn, write_metrics);
+}
 
-    sprintf(lbuf, "Hostname: %s<br>", wifi_station_get_hostname());
-    httpserver_write_string(conn, lbuf);
+// Rendered once per sample and sent to every /events subscriber; the JSON
+// in the data line also goes to WebSocket clients
+#define EVENT_PREFIX "event: sample\ndata: "
+#define EVENT_SUFFIX "\n\n"
 
-    struct ip_info info;
-    wifi_get_ip_info(STATION_IF, &info);
-    sprintf(lbuf, "IP address: %d.%d.%d.%d<br>", IP2STR(&info.ip));
-    httpserver_write_string(conn, lbuf);
+static char event_buf[512];
+static int event_len;
+static uint32_t event_gen;
 
-    uint8 mac[6];
-    wifi_get_macaddr(STATION_IF, mac);
-    sprintf(lbuf, "MAC address: %02x:%02x:%02x:%02x:%02x:%02x<br></p>",
-            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-    httpserver_write_string(conn, lbuf);
+// Returns the length of the event for the current generation, or -1
+ICACHE_FLASH_ATTR
+static int render_sample_event(void)
+{
+    uint32_t gen = sensors_generation();
 
-    for (int i = 0; i < MAX_SENSORS; i++) {
-        if (!bme_present[i])
-            continue;
+    if (event_len > 0 && event_gen == gen)
+        return event_len;
 
-        sprintf(lbuf, "<h3>Sensor %d</h3><p>", i);
-        httpserver_write_string(conn, lbuf);
+    int len = snprintf(event_buf, sizeof(event_buf), EVENT_PREFIX "{\"sensors\":[");
+    int first = 1;
 
-        ret = bme280_set_sensor_mode(BME280_FORCED_MODE, &bme[i]);
-        if (ret != BME280_OK) {
-            sprintf(lbuf, "Failed to set mode (%d).</p>", ret);
-            httpserver_write_string(conn, lbuf);
-            continue;
-        }
-        for (int j = 0; j < 1000; j++) {
-            if (!bme280_is_busy(&bme[i]))
-                break;
-            os_delay_us(100);
-        }
-        if (bme280_is_busy(&bme[i])) {
-            httpserver_write_string(conn, "Timed out waiting for measurement.</p>");
-            continue;
-        }
-        struct bme280_data comp_data;
-        ret = bme280_get_sensor_data(BME280_ALL, &comp_data, &bme[i]);
-        if (ret != BME280_OK) {
-            sprintf(lbuf, "Failed to read data (%d).</p>", ret);
-            httpserver_write_string(conn, lbuf);
+    for (int i = 0; i < MAX_SENSORS && len < sizeof(event_buf); i++) {
+        if (!bme_present[i])
             continue;
-        }
-        sprintf(lbuf,
-                "Temperature: %.02f &deg;C<br>"
-                "Pressure: %.02f hPa<br>"
-                "Humidity: %.02f RH%%</p>",
-                comp_data.temperature,
-                comp_data.pressure / 100.0,
-                comp_data.humidity);
-        httpserver_write_string(conn, lbuf);
-    }
 
-    httpserver_write_string(conn, "</body></html>");
+        const struct sensor_sample *s = sensors_get_sample(i);
+        len += snprintf(event_buf + len, sizeof(event_buf) - len,
+                        "%s{\"id\":%d,\"status\":%d,\"temperature\":%.02f,"
+                        "\"pressure\":%.02f,\"humidity\":%.02f,\"age\":%.03f}",
+                        first ? "" : ",", i, s->status, s->data.temperature,
+                        s->data.pressure, s->data.humidity,
+                        sensors_sample_age_us(i) / 1000000.0);
+        first = 0;
+    }
+    if (len < sizeof(event_buf))
+        len += snprintf(event_buf + len, sizeof(event_buf) - len, "]}" EVENT_SUFFIX);
+    if (len >= sizeof(event_buf)) {
+        LOG_WARN("events: event too long\n");
+        event_len = 0;
+        return -1;
+    }
+    event_len = len;
+    event_gen = gen;
+    return len;
 }
 
 ICACHE_FLASH_ATTR
-void handle_metrics(httpconn_t *conn, char *path, char *query_string)
+static void publish_sample(void)
 {
-    char lbuf[256];
-    int read_ok[MAX_SENSORS];
-    int ret;
-    struct bme280_data comp_data[MAX_SENSORS];
+    if (!hs)
+        return;
 
+    int len = render_sample_event();
+    if (len < 0)
+        return;
+    httpserver_broadcast(hs, event_buf, len);
+    // WebSocket handlers send it themselves
+    httpserver_ws_wake_all(hs);
+}
+
+ICACHE_FLASH_ATTR
+void handle_events(httpconn_t *conn, char *path, char *query_string)
+{
     httpserver_end_request(conn);
+    if (httpserver_subscribe(conn) < 0 && httpserver_get_method(conn) != HTTP_METHOD_HEAD) {
+        httpserver_start_response(conn, 503, "Service Unavailable");
+        httpserver_send_content_length(conn, 0);
+        httpserver_end_headers(conn);
+        return;
+    }
+
     httpserver_start_response(conn, 200, "OK");
-    httpserver_send_header(conn, "Content-Type", "text/plain; version=0.0.4");
+    httpserver_send_header(conn, "Content-Type", "text/event-stream");
+    httpserver_send_header(conn, "Cache-Control", "no-cache");
     httpserver_end_headers(conn);
+    // Tell the browser how soon to reconnect
+    httpserver_write_string(conn, "retry: 5000\n\n");
+}
 
-    for (int i = 0; i < MAX_SENSORS; i++) {
-        read_ok[i] = 0;
-        if (!bme_present[i])
-            continue;
-        ret = bme280_set_sensor_mode(BME280_FORCED_MODE, &bme[i]);
-        if (ret != BME280_OK) {
-            sprintf(lbuf, "# sensor=%d failed to set mode (%d)\n", i, ret);
-            httpserver_write_string(conn, lbuf);
-            sprintf(lbuf, "sensor_read_status{sensor=\"%d\"} %d\n", i, ret );
-            httpserver_write_string(conn, lbuf);
-            continue;
-        }
-        for (int j = 0; j < 1000; j++) {
-            if (!bme280_is_busy(&bme[i]))
-                break;
-            os_delay_us(100);
-        }
-        if (bme280_is_busy(&bme[i])) {
-            sprintf(lbuf, "# sensor=%d timed out\n", i);
-            httpserver_write_string(conn, lbuf);
-            sprintf(lbuf, "sensor_read_status{sensor=\"%d\"} %d\n", i, -100);
-            httpserver_write_string(conn, lbuf);
-            continue;
-        }
-        ret = bme280_get_sensor_data(BME280_ALL, &comp_data[i], &bme[i]);
-        if (ret != BME280_OK) {
-            sprintf(lbuf, "# sensor=%d failed to read data (%d)\n", i, ret);
-            httpserver_write_string(conn, lbuf);
-            sprintf(lbuf, "sensor_read_status{sensor=\"%d\"} %d\n", i, ret - 200);
-            httpserver_write_string(conn, lbuf);
-            continue;
-        }
-        read_ok[i] = 1;
-        if (read_ok[i]) {
-            sprintf(lbuf, "sensor_read_status{sensor=\"%d\"} 0\n", i);
-            httpserver_write_string(conn, lbuf);
-        }
-    }
+// Pushes every new sample as a text message, and takes commands:
+// "sample" resends the current one
+ICACHE_FLASH_ATTR
+void handle_ws(httpconn_t *conn, char *path, char *query_string)
+{
+    char cmd[64];
+    uint32_t sent_gen = 0;
+    int opcode;
 
-    for (int i = 0; i < MAX_SENSORS; i++) {
-        if (read_ok[i]) {
-            sprintf(lbuf, "sensor_temperature_celsius{sensor=\"%d\"} %.02f\n",
-                    i, comp_data[i].temperature);
-            httpserver_write_string(conn, lbuf);
-        }
-    }
+    if (httpserver_ws_accept(conn) < 0)
+        return;
 
-    for (int i = 0; i < MAX_SENSORS; i++) {
-        if (read_ok[i]) {
-            sprintf(lbuf, "sensor_pressure_pascals{sensor=\"%d\"} %.02f\n",
-                    i, comp_data[i].pressure);
-            httpserver_write_string(conn, lbuf);
+    for (;;) {
+        if (sent_gen != sensors_generation()) {
+            int len = render_sample_event();
+            if (len > 0) {
+                // Just the JSON from the data line
+                httpserver_ws_send(conn, HTTP_WS_TEXT, event_buf + strlen(EVENT_PREFIX),
+                                   len - strlen(EVENT_PREFIX) - strlen(EVENT_SUFFIX));
+            }
+            sent_gen = sensors_generation();
         }
-    }
 
-    for (int i = 0; i < MAX_SENSORS; i++) {
-        if (read_ok[i]) {
-            sprintf(lbuf, "sensor_humidity_relative{sensor=\"%d\"} %.05f\n",
-                    i, comp_data[i].humidity / 100.0f);
-            httpserver_write_string(conn, lbuf);
+        int ret = httpserver_ws_read(conn, cmd, sizeof(cmd) - 1, &opcode);
+        if (ret == HTTP_WS_CLOSED)
+            break;
+        if (ret == HTTP_WS_WOKEN || opcode != HTTP_WS_TEXT)
+            continue;
+        cmd[ret] = '\0';
+
+        if (!strcmp(cmd, "sample")) {
+            sent_gen = 0;
+        } else {
+            const char *err = "{\"error\":\"unknown command\"}";
+            httpserver_ws_send(conn, HTTP_WS_TEXT, err, strlen(err));
         }
     }
-
 }
 
 ICACHE_FLASH_ATTR
 void handle_ir(httpconn_t *conn, char *path, char *query_string)
 {
-    httpserver_end_request(conn);
-    httpserver_start_response(conn, 200, "OK");
+    char buf[128];
+    int total = 0;
+    int ret;
+
+    // There is no IR transmitter support yet. The body is still read in
+    // full, so the connection stays usable, but nothing is sent.
+    while ((ret = httpserver_read_body(conn, buf, sizeof(buf))) > 0)
+        total += ret;
+    if (ret < 0) {
+        httpserver_start_response(conn, 400, "Bad Request");
+        httpserver_send_content_length(conn, 0);
+        httpserver_end_headers(conn);
+        return;
+    }
+    LOG_DEBUG("ir: %d byte body\n", total);
+
+    static const char msg[] = "IR sending is not implemented\n";
+    httpserver_start_response(conn, 501, "Not Implemented");
+    httpserver_send_header(conn, "Content-Type", "text/plain");
+    httpserver_send_content_length(conn, sizeof(msg) - 1);
     httpserver_end_headers(conn);
+    httpserver_write_data(conn, msg, sizeof(msg) - 1);
 }
 
+static const struct httproute routes[] ICACHE_RODATA_ATTR = {
+    { "/", HTTP_METHOD_GET, assets_handle },
+    { "/assets/*", HTTP_METHOD_GET, assets_handle },
+    { "/status.json", HTTP_METHOD_GET, handle_status },
+    { "/metrics", HTTP_METHOD_GET, handle_metrics },
+    { "/events", HTTP_METHOD_GET, handle_events },
+    { "/ws", HTTP_METHOD_GET, handle_ws },
+    { "/ir", HTTP_METHOD_POST | HTTP_METHOD_PUT, handle_ir },
+    { "/debug/trace", HTTP_METHOD_GET, trace_handle },
+};
+
 ICACHE_FLASH_ATTR
 void user_set_station_config(void)
 {
@@ -304,75 +427,27 @@ void user_set_station_config(void)
 ICACHE_FLASH_ATTR
 void init_done(void)
 {
-    os_printf("init_done\n");
+    LOG_INFO("init_done\n");
     wifi_set_opmode(STATION_MODE);
     wifi_set_sleep_type(LIGHT_SLEEP_T);
 
     user_set_station_config();
 
-    for (int i = 0; i < MAX_SENSORS; i++) {
-        bme_present[i] = 0;
-        bme[i].dev_id = addresses[i];
-        bme[i].intf = BME280_I2C_INTF;
-        bme[i].read = user_i2c_read;
-        bme[i].write = user_i2c_write;
-        bme[i].delay_ms = user_delay_ms;
-
-        if (bme280_init(&bme[i]) != BME280_OK) {
-            os_printf("bme[%d]: absent\n", i);
-            continue;
-        }
-
-        os_printf("bme[%d]: present\n", i);
-        if (bme280_soft_reset(&bme[i]) != BME280_OK) {
-            os_printf("bme[%d]: soft reset failed\n", i);
-            continue;
-        }
-        if (bme280_set_sensor_mode(BME280_SLEEP_MODE, &bme[i]) != BME280_OK) {
-            os_printf("bme[%d]: set sleep mode failed\n", i);
-            continue;
-        }
-        bme[i].settings.osr_h = BME280_OVERSAMPLING_16X;
-        bme[i].settings.osr_p = BME280_OVERSAMPLING_2X;
-        bme[i].settings.osr_t = BME280_OVERSAMPLING_2X;
-        bme[i].settings.filter = BME280_FILTER_COEFF_OFF;
-
-        int settings_sel = BME280_OSR_PRESS_SEL | BME280_OSR_TEMP_SEL |
-                           BME280_OSR_HUM_SEL | BME280_FILTER_SEL;
+    sntp_setservername(0, CONFIG_NTP_SERVER);
+    sntp_set_timezone(0);
+    sntp_init();
 
-        if (bme280_set_sensor_settings(settings_sel, &bme[i]) != BME280_OK) {
-            os_printf("bme[%d]: set sensor settings failed\n", i);
-            continue;
-        }
-        if (bme280_set_sensor_mode(BME280_FORCED_MODE, &bme[i]) != BME280_OK) {
-            os_printf("bme[%d]: set forced mode failed\n", i);
-            continue;
-        }
-        for (int j = 0; j < 1000; j++) {
-            if (!bme280_is_busy(&bme[i]))
-                break;
-            os_delay_us(100);
-        }
-        if (bme280_is_busy(&bme[i])) {
-            os_printf("bme[%d]: timed out testing measurement\n", i);
-            continue;
-        }
-        struct bme280_data comp_data;
-        bme280_get_sensor_data(BME280_ALL, &comp_data, &bme[i]);
-        printf("bme[%d]: %0.2f C   %0.2f %%   %0.2f Pa\r\n", i, 
-               comp_data.temperature, comp_data.pressure, comp_data.humidity);
-        bme_present[i] = 1;
-    }
+    sensors_init();
+    sensors_set_listener(publish_sample);
+    sensors_start();
 
-    hs = httpserver_init(80, 2);
+    hs = httpserver_init(80, HTTP_DEFAULT_MAXCONNS);
     if (!hs) {
-        os_printf("HTTP server init failed!\n");
+        LOG_ERROR("HTTP server init failed!\n");
         return;
     }
 
-    httpserver_route(hs, "/", handle_root);
-    httpserver_route(hs, "/metrics", handle_metrics);
-    httpserver_route(hs, "/ir", handle_ir);
+    httpserver_set_routes(hs, routes, sizeof(routes) / sizeof(routes[0]));
 
     httpserver_start(hs);
 
@@ -382,12 +457,13 @@ ICACHE_FLASH_ATTR
 void user_init(void)
 {
     uart_div_modify(0, UART_CLK_FREQ / 115200);
-    os_printf("\n\n\n");
-    os_printf("SDK version:%s\n", system_get_sdk_version());
+    log_init();
+    LOG_INFO("\n\n\n");
+    LOG_INFO("SDK version:%s\n", system_get_sdk_version());
 
     system_init_done_cb(init_done);
 
     i2c_master_gpio_init();
 
-    os_printf("user_init done\n");
+    LOG_INFO("user_init done\n");
 }
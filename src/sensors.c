@@ -0,0 +1,325 @@
+#include "config.h"
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+
+#include "printf.h"
+#include "i2c_master.h"
+#include "contwait.h"
+#include "sensors.h"
+#include "trace.h"
+#include "log.h"
+
+#ifndef CONFIG_SAMPLE_INTERVAL_MS
+#define CONFIG_SAMPLE_INTERVAL_MS 10000
+#endif
+
+// How long to keep polling the status register past the computed
+// conversion time before giving up
+#define SENSOR_BUSY_TIMEOUT_MS 20
+
+int bme_present[MAX_SENSORS] = { 0 };
+struct bme280_dev bme[MAX_SENSORS];
+const int addresses[MAX_SENSORS] = {
+  0x76, 0x77
+};
+
+static struct sensor_sample samples[MAX_SENSORS];
+static uint32_t generation;
+static void (*listener)(void);
+static struct histogram read_us;
+static os_timer_t sample_timer;
+
+static cont_t sample_cont;
+static contwait_t sample_wait;
+static int sample_running;
+
+void user_delay_ms(uint32_t period)
+{
+    if (contwait_can_sleep())
+        contwait_sleep_ms(period);
+    else
+        os_delay_us(1000 * period);
+}
+
+int8_t user_i2c_read(uint8_t dev_id, uint8_t reg_addr, uint8_t *reg_data, uint16_t len)
+{
+    i2c_master_start();
+    i2c_master_writeByte(dev_id << 1);
+    if (i2c_master_getAck()) {
+        i2c_master_stop();
+        return -1;
+    }
+    i2c_master_writeByte(reg_addr);
+    if (i2c_master_getAck()) {
+        i2c_master_stop();
+        return -1;
+    }
+    i2c_master_stop();
+    i2c_master_start();
+    i2c_master_writeByte((dev_id << 1) | 1);
+    if (i2c_master_getAck()) {
+        i2c_master_stop();
+        return -1;
+    }
+
+    while (len--) {
+        *reg_data++ = i2c_master_readByte();
+        i2c_master_setAck(len == 0);
+    }
+
+    i2c_master_stop();
+    return 0;
+}
+
+int8_t user_i2c_write(uint8_t dev_id, uint8_t reg_addr, uint8_t *reg_data, uint16_t len)
+{
+    i2c_master_start();
+    i2c_master_writeByte(dev_id << 1);
+    if (i2c_master_getAck()) {
+        i2c_master_stop();
+        return -1;
+    }
+    i2c_master_writeByte(reg_addr);
+    if (i2c_master_getAck()) {
+        i2c_master_stop();
+        return -1;
+    }
+
+    while (len--) {
+        i2c_master_writeByte(*reg_data++);
+        if (i2c_master_getAck()) {
+            i2c_master_stop();
+            return -1;
+        }
+    }
+
+    i2c_master_stop();
+    return 0;
+}
+
+ICACHE_FLASH_ATTR
+int sensors_measure(int i, struct bme280_data *data)
+{
+    int ret;
+
+    ret = bme280_set_sensor_mode(BME280_FORCED_MODE, &bme[i]);
+    if (ret != BME280_OK)
+        return ret;
+
+    // Sleeps in the calling continuation if possible, blocks otherwise
+    user_delay_ms(bme280_cal_meas_delay(&bme[i].settings));
+    for (int j = 0; j < SENSOR_BUSY_TIMEOUT_MS; j++) {
+        if (!bme280_is_busy(&bme[i]))
+            break;
+        user_delay_ms(1);
+    }
+    if (bme280_is_busy(&bme[i]))
+        return SENSOR_TIMEOUT;
+
+    ret = bme280_get_sensor_data(BME280_ALL, data, &bme[i]);
+    if (ret != BME280_OK)
+        return SENSOR_READ_FAILED + ret;
+
+    return SENSOR_OK;
+}
+
+ICACHE_FLASH_ATTR
+void sensors_measure_all(struct bme280_data *data, int *status)
+{
+    uint32_t delay = 0;
+    int ret;
+
+    // Start every conversion first so they run concurrently
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        if (!bme_present[i])
+            continue;
+
+        status[i] = bme280_set_sensor_mode(BME280_FORCED_MODE, &bme[i]);
+        if (status[i] != BME280_OK)
+            continue;
+
+        uint32_t d = bme280_cal_meas_delay(&bme[i].settings);
+        if (d > delay)
+            delay = d;
+    }
+
+    if (delay)
+        user_delay_ms(delay);
+
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        if (!bme_present[i] || status[i] != BME280_OK)
+            continue;
+
+        for (int j = 0; j < SENSOR_BUSY_TIMEOUT_MS; j++) {
+            if (!bme280_is_busy(&bme[i]))
+                break;
+            user_delay_ms(1);
+        }
+        if (bme280_is_busy(&bme[i])) {
+            status[i] = SENSOR_TIMEOUT;
+            continue;
+        }
+
+        ret = bme280_get_sensor_data(BME280_ALL, &data[i], &bme[i]);
+        if (ret != BME280_OK) {
+            status[i] = SENSOR_READ_FAILED + ret;
+            continue;
+        }
+        status[i] = SENSOR_OK;
+    }
+}
+
+ICACHE_FLASH_ATTR
+static void sensors_sample(void *arg)
+{
+    struct bme280_data data[MAX_SENSORS];
+    int status[MAX_SENSORS];
+    uint32_t start = system_get_time();
+
+    trace(TRACE_SENSOR_START, TRACE_NO_SLOT, 0, 0);
+    sensors_measure_all(data, status);
+
+    uint32_t now = system_get_time();
+    histogram_record(&read_us, now - start);
+    int changed = 0;
+    int read = 0, failed = 0;
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        if (!bme_present[i])
+            continue;
+
+        if (samples[i].status != status[i])
+            changed = 1;
+        samples[i].status = status[i];
+        if (status[i] != SENSOR_OK) {
+            LOG_WARN("bme[%d]: sample failed (%d)\n", i, status[i]);
+            failed++;
+            continue;
+        }
+        read++;
+        samples[i].data = data[i];
+        samples[i].timestamp = now;
+        changed = 1;
+    }
+    trace(TRACE_SENSOR_END, TRACE_NO_SLOT, read, failed);
+
+    if (changed) {
+        generation++;
+        if (listener)
+            listener();
+    }
+    sample_running = 0;
+}
+
+ICACHE_FLASH_ATTR
+static void sensors_run(void *arg)
+{
+    contwait_run(&sample_wait, sensors_sample, NULL);
+}
+
+ICACHE_FLASH_ATTR
+static void sensors_tick(void *arg)
+{
+    // Previous sample still waiting on a conversion, or on its first run if
+    // contwait_run() was refused (it retries through sensors_run())
+    if (sample_running)
+        return;
+    sample_running = 1;
+    sensors_run(NULL);
+}
+
+ICACHE_FLASH_ATTR
+const struct sensor_sample *sensors_get_sample(int i)
+{
+    return &samples[i];
+}
+
+ICACHE_FLASH_ATTR
+uint32_t sensors_generation(void)
+{
+    return generation;
+}
+
+ICACHE_FLASH_ATTR
+void sensors_set_listener(void (*fn)(void))
+{
+    listener = fn;
+}
+
+ICACHE_FLASH_ATTR
+const struct histogram *sensors_read_histogram(void)
+{
+    return &read_us;
+}
+
+ICACHE_FLASH_ATTR
+uint32_t sensors_sample_age_us(int i)
+{
+    return system_get_time() - samples[i].timestamp;
+}
+
+ICACHE_FLASH_ATTR
+void sensors_init(void)
+{
+    generation = 1;
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        bme_present[i] = 0;
+        samples[i].status = SENSOR_NOT_SAMPLED;
+        bme[i].dev_id = addresses[i];
+        bme[i].intf = BME280_I2C_INTF;
+        bme[i].read = user_i2c_read;
+        bme[i].write = user_i2c_write;
+        bme[i].delay_ms = user_delay_ms;
+
+        if (bme280_init(&bme[i]) != BME280_OK) {
+            LOG_INFO("bme[%d]: absent\n", i);
+            continue;
+        }
+
+        LOG_INFO("bme[%d]: present\n", i);
+        if (bme280_soft_reset(&bme[i]) != BME280_OK) {
+            LOG_ERROR("bme[%d]: soft reset failed\n", i);
+            continue;
+        }
+        if (bme280_set_sensor_mode(BME280_SLEEP_MODE, &bme[i]) != BME280_OK) {
+            LOG_ERROR("bme[%d]: set sleep mode failed\n", i);
+            continue;
+        }
+        bme[i].settings.osr_h = BME280_OVERSAMPLING_16X;
+        bme[i].settings.osr_p = BME280_OVERSAMPLING_2X;
+        bme[i].settings.osr_t = BME280_OVERSAMPLING_2X;
+        bme[i].settings.filter = BME280_FILTER_COEFF_OFF;
+
+        int settings_sel = BME280_OSR_PRESS_SEL | BME280_OSR_TEMP_SEL |
+                           BME280_OSR_HUM_SEL | BME280_FILTER_SEL;
+
+        if (bme280_set_sensor_settings(settings_sel, &bme[i]) != BME280_OK) {
+            LOG_ERROR("bme[%d]: set sensor settings failed\n", i);
+            continue;
+        }
+        struct bme280_data comp_data;
+        int ret = sensors_measure(i, &comp_data);
+        if (ret != SENSOR_OK) {
+            LOG_ERROR("bme[%d]: test measurement failed (%d)\n", i, ret);
+            continue;
+        }
+        LOG_INFO("bme[%d]: %0.2f C   %0.2f %%   %0.2f Pa\n", i,
+                 comp_data.temperature, comp_data.pressure, comp_data.humidity);
+        samples[i].data = comp_data;
+        samples[i].timestamp = system_get_time();
+        samples[i].status = SENSOR_OK;
+        bme_present[i] = 1;
+    }
+}
+
+ICACHE_FLASH_ATTR
+void sensors_start(void)
+{
+    cont_init(&sample_cont);
+    contwait_init(&sample_wait, &sample_cont, sensors_run, NULL);
+
+    os_timer_disarm(&sample_timer);
+    os_timer_setfn(&sample_timer, sensors_tick, NULL);
+    os_timer_arm(&sample_timer, CONFIG_SAMPLE_INTERVAL_MS, 1);
+}
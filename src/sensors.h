@@ -0,0 +1,43 @@
+#include "bme280.h"
+#include "histogram.h"
+
+#define MAX_SENSORS 2
+
+// Status codes for a sensor sample (negative BME280 error codes are
+// reported as-is when setting the mode fails)
+#define SENSOR_OK 0
+#define SENSOR_TIMEOUT -100
+#define SENSOR_READ_FAILED -200
+#define SENSOR_NOT_SAMPLED -300
+
+struct sensor_sample {
+    struct bme280_data data;
+    // system_get_time() of the last successful read
+    uint32_t timestamp;
+    // Result of the last read attempt
+    int status;
+};
+
+extern int bme_present[MAX_SENSORS];
+
+void sensors_init(void);
+void sensors_start(void);
+
+// Run a forced mode conversion on sensor i. When called from a continuation
+// the conversion time is spent yielded instead of busy-waiting.
+int sensors_measure(int i, struct bme280_data *data);
+// Same for all present sensors at once: every conversion is started before
+// waiting, so the total wait is that of the slowest sensor
+void sensors_measure_all(struct bme280_data *data, int *status);
+
+const struct sensor_sample *sensors_get_sample(int i);
+// Advances whenever a sample is updated, so anything rendered from the
+// samples can be cached until it changes
+uint32_t sensors_generation(void);
+// Called whenever the generation advances. Runs in the sampling
+// continuation, so it must not block.
+void sensors_set_listener(void (*fn)(void));
+uint32_t sensors_sample_age_us(int i);
+// Time taken by each background sample of all sensors, from starting
+// the conversions to having read the results
+const struct histogram *sensors_read_histogram(void);
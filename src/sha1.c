@@ -0,0 +1,82 @@
+#include "c_types.h"
+#include "osapi.h"
+
+#include "sha1.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+ICACHE_FLASH_ATTR
+static void sha1_block(uint32_t *h, const uint8_t *p)
+{
+    uint32_t w[16];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (p[4 * i] << 24) | (p[4 * i + 1] << 16) | (p[4 * i + 2] << 8) | p[4 * i + 3];
+
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+
+        // The message schedule is kept as a 16 word ring
+        if (i >= 16) {
+            uint32_t t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15];
+            w[i & 15] = ROL(t, 1);
+        }
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = ROL(a, 5) + f + e + k + w[i & 15];
+        e = d;
+        d = c;
+        c = ROL(b, 30);
+        b = a;
+        a = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+ICACHE_FLASH_ATTR
+void sha1(const void *data, size_t len, uint8_t *digest)
+{
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    const uint8_t *p = data;
+    uint8_t block[64];
+    size_t left = len;
+
+    while (left >= 64) {
+        sha1_block(h, p);
+        p += 64;
+        left -= 64;
+    }
+
+    // Padding: 0x80, zeros, then the length in bits, big endian
+    memset(block, 0, sizeof(block));
+    memcpy(block, p, left);
+    block[left] = 0x80;
+    if (left >= 56) {
+        sha1_block(h, block);
+        memset(block, 0, sizeof(block));
+    }
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++)
+        block[63 - i] = bits >> (8 * i);
+    sha1_block(h, block);
+
+    for (int i = 0; i < 20; i++)
+        digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
@@ -0,0 +1,7 @@
+#include "c_types.h"
+
+#define SHA1_DIGEST_SIZE 20
+
+// One-shot SHA-1, for the WebSocket handshake (not for anything that
+// needs collision resistance)
+void sha1(const void *data, size_t len, uint8_t *digest);
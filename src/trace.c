@@ -0,0 +1,77 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+
+#include "httpserver.h"
+#include "trace.h"
+
+#if TRACE_RECORDS
+
+#if TRACE_RECORDS & (TRACE_RECORDS - 1)
+#error TRACE_RECORDS must be a power of two
+#endif
+
+// A dump whose client went away never unpauses by itself
+#define TRACE_PAUSE_MAX_MS 5000
+
+static struct trace_record records[TRACE_RECORDS];
+// Total records ever written; the newest is at (head - 1) % TRACE_RECORDS
+static uint32_t head;
+static int paused;
+static uint32_t paused_at;
+
+ICACHE_FLASH_ATTR
+void trace(int event, int slot, uint32_t a, uint32_t b)
+{
+    if (paused) {
+        if (system_get_time() - paused_at < TRACE_PAUSE_MAX_MS * 1000)
+            return;
+        paused = 0;
+    }
+
+    struct trace_record *r = &records[head++ & (TRACE_RECORDS - 1)];
+    r->timestamp = system_get_time();
+    r->event = event;
+    r->slot = slot;
+    r->a = a;
+    r->b = b;
+}
+
+#endif
+
+ICACHE_FLASH_ATTR
+void trace_handle(httpconn_t *conn, char *path, char *query_string)
+{
+#if TRACE_RECORDS
+    struct trace_header hdr = { { 'T', 'R', 'C', '1' }, 1, sizeof(struct trace_record) };
+
+    httpserver_end_request(conn);
+    // Writing the response can yield, so the ring is frozen until the
+    // whole dump is out
+    paused = 1;
+    paused_at = system_get_time();
+
+    uint32_t count = head < TRACE_RECORDS ? head : TRACE_RECORDS;
+    uint32_t first = head - count;
+    hdr.records = count;
+    hdr.overwritten = first;
+
+    httpserver_start_response(conn, 200, "OK");
+    httpserver_send_header(conn, "Content-Type", "application/octet-stream");
+    httpserver_send_header(conn, "Cache-Control", "no-store");
+    httpserver_send_content_length(conn, sizeof(hdr) + count * sizeof(struct trace_record));
+    httpserver_end_headers(conn);
+    httpserver_write_data(conn, &hdr, sizeof(hdr));
+
+    // Oldest records first; the ring may wrap once
+    uint32_t start = first & (TRACE_RECORDS - 1);
+    uint32_t n = TRACE_RECORDS - start < count ? TRACE_RECORDS - start : count;
+    httpserver_write_data(conn, &records[start], n * sizeof(struct trace_record));
+    httpserver_write_data(conn, &records[0], (count - n) * sizeof(struct trace_record));
+    httpserver_flush(conn);
+
+    paused = 0;
+#else
+    httpserver_handle_404(conn, path, query_string);
+#endif
+}
@@ -0,0 +1,67 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "c_types.h"
+#include "httpserver.h"
+
+// Binary event trace kept in a RAM ring buffer, for looking at timing
+// without printing to the UART. /debug/trace dumps it and
+// tools/tracedump.py turns the dump into Chrome trace JSON. Build with
+// TRACE_RECORDS=0 to compile it out.
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS 128
+#endif
+
+// Keep in sync with EVENTS in tools/tracedump.py
+enum {
+    TRACE_ACCEPT = 1,       // a: queued (1) or not, b: accept queue depth
+    TRACE_RUN,              // coroutine resumed
+    TRACE_RUN_END,          // coroutine yielded or exited
+    TRACE_YIELD_READ,       // a: bytes queued
+    TRACE_YIELD_WRITE,      // a: bytes left to write, b: send buffer space
+    TRACE_RECV,             // a: bytes received (0 at EOF)
+    TRACE_RECVED,           // a: bytes acknowledged to lwIP
+    TRACE_WRITE,            // a: bytes, b: tcp_write() result
+    TRACE_SENT,             // a: bytes acknowledged by the peer
+    TRACE_HANDLER,          // a: route index or TRACE_NO_ROUTE
+    TRACE_RESPONSE,         // a: body bytes, b: requests on the connection
+    TRACE_CLOSE,            // a: 0 close, 1 abort, 2 error
+    TRACE_SENSOR_START,
+    TRACE_SENSOR_END,       // a: sensors read, b: sensors failed
+};
+
+// Slot number for events that do not belong to a connection
+#define TRACE_NO_SLOT 0xffff
+// TRACE_HANDLER route for requests answered by the server itself (404,
+// 405, malformed requests), so every TRACE_RESPONSE has a start
+#define TRACE_NO_ROUTE 0xffffffff
+
+struct trace_record {
+    uint32_t timestamp;
+    uint16_t event;
+    uint16_t slot;
+    uint32_t a;
+    uint32_t b;
+};
+
+struct trace_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t records;
+    // Records lost to wrapping since boot
+    uint32_t overwritten;
+};
+
+#if TRACE_RECORDS
+void trace(int event, int slot, uint32_t a, uint32_t b);
+#else
+#define trace(event, slot, a, b) do { } while (0)
+#endif
+
+// Handler for /debug/trace: the records, oldest first, after a header
+// (struct trace_header). Tracing stops while the dump is being written,
+// for at most a few seconds.
+void trace_handle(httpconn_t *conn, char *path, char *query_string);
+
+#endif
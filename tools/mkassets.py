@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# Generate a C table of static assets for serving from flash.
+#
+# Each asset is stored as-is and, if that is smaller, gzipped. assets/index.html
+# is served at /, everything else at /assets/<file name>.
+
+import argparse, gzip, hashlib, os, sys
+
+TYPES = {
+    ".html": "text/html; charset=utf-8",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".ico": "image/x-icon",
+    ".txt": "text/plain",
+}
+
+def c_array(f, name, data):
+    # Aligned so the server can read it from flash a word at a time
+    f.write("static const uint8_t %s[] ICACHE_RODATA_ATTR __attribute__((aligned(4))) = {\n" % name)
+    for i in range(0, len(data), 16):
+        f.write("    " + " ".join("0x%02x," % b for b in data[i:i + 16]) + "\n")
+    f.write("};\n\n")
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("-o", "--output", required=True, help="C file to write")
+    ap.add_argument("files", nargs="*")
+    args = ap.parse_args()
+
+    assets = []
+    for fn in sorted(args.files):
+        base = os.path.basename(fn)
+        ext = os.path.splitext(base)[1]
+        if ext not in TYPES:
+            sys.stderr.write("mkassets: skipping %s (unknown type)\n" % fn)
+            continue
+        with open(fn, "rb") as fd:
+            data = fd.read()
+        # mtime=0 keeps the output reproducible
+        gz = gzip.compress(data, 9, mtime=0)
+        if len(gz) >= len(data):
+            gz = None
+        path = "/" if base == "index.html" else "/assets/" + base
+        # Each encoding is a different representation with its own ETag
+        etag = hashlib.sha1(data).hexdigest()[:16]
+        assets.append((path, TYPES[ext], data, gz, etag))
+
+    with open(args.output, "w") as f:
+        f.write("// Generated by tools/mkassets.py, do not edit\n\n")
+        f.write('#include "c_types.h"\n#include "assets.h"\n\n')
+        for i, (path, ctype, data, gz, etag) in enumerate(assets):
+            c_array(f, "asset_%d" % i, data)
+            if gz:
+                c_array(f, "asset_%d_gz" % i, gz)
+        f.write("const struct asset assets[] ICACHE_RODATA_ATTR = {\n")
+        for i, (path, ctype, data, gz, etag) in enumerate(assets):
+            gzname = "asset_%d_gz" % i if gz else "NULL"
+            f.write('    { "%s", "%s", asset_%d, %d, %s, %d, "\\"%s\\"", "\\"%s-gz\\"" },\n' %
+                    (path, ctype, i, len(data), gzname, len(gz) if gz else 0, etag, etag))
+        f.write("};\n\n")
+        f.write("const uint32_t asset_count ICACHE_RODATA_ATTR = %d;\n" % len(assets))
+
+        total = sum(len(data) + len(gz or b"") for path, ctype, data, gz, etag in assets)
+        sys.stderr.write("mkassets: %d assets, %d bytes stored\n" % (len(assets), total))
+
+if __name__ == "__main__":
+    main()
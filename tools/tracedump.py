@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+# Convert a /debug/trace dump into Chrome trace JSON (chrome://tracing,
+# ui.perfetto.dev).
+#
+#   tools/tracedump.py http://node/debug/trace -o trace.json
+#   tools/tracedump.py dump.bin -o trace.json
+
+import argparse, json, struct, sys, urllib.request
+
+HEADER = struct.Struct("<4sHHII")
+RECORD = struct.Struct("<IHHII")
+NO_SLOT = 0xffff
+
+# Same order as the enum in src/trace.h: (name, argument names)
+EVENTS = [
+    None,
+    ("accept", ("queued", "queue_depth")),
+    ("run", ()),
+    ("run_end", ()),
+    ("yield_read", ("queued",)),
+    ("yield_write", ("left", "sndbuf")),
+    ("recv", ("bytes",)),
+    ("recved", ("bytes",)),
+    ("tcp_write", ("bytes", "err")),
+    ("sent", ("bytes",)),
+    ("handler", ("route",)),
+    ("response", ("body_bytes", "requests")),
+    ("close", ("how",)),
+    ("sensor_start", ()),
+    ("sensor_end", ("read", "failed")),
+]
+
+# Begin/end pairs become duration events, everything else is instant.
+# Requests span several runs of their coroutine, so they cannot nest with
+# them on one thread; they become async events on a track of their own.
+BEGIN = {"run": "run", "handler": "request", "sensor_start": "sensors"}
+END = {"run_end": "run", "response": "request", "sensor_end": "sensors"}
+ASYNC = {"request"}
+
+# TRACE_HANDLER route for requests that matched no route
+NO_ROUTE = 0xffffffff
+
+def signed(v):
+    return v - (1 << 32) if v & (1 << 31) else v
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("source", help="dump file or /debug/trace URL")
+    ap.add_argument("-o", "--output", help="JSON file to write (default stdout)")
+    args = ap.parse_args()
+
+    if "://" in args.source:
+        data = urllib.request.urlopen(args.source).read()
+    else:
+        with open(args.source, "rb") as fd:
+            data = fd.read()
+
+    magic, version, record_size, count, overwritten = HEADER.unpack_from(data)
+    if magic != b"TRC1" or version != 1 or record_size != RECORD.size:
+        sys.exit("tracedump: not a version 1 trace dump")
+    if len(data) < HEADER.size + count * record_size:
+        sys.exit("tracedump: dump is truncated")
+    if overwritten:
+        sys.stderr.write("tracedump: %d older records were overwritten\n" % overwritten)
+
+    events = []
+    slots = set()
+    # (slot, span name) -> begin event waiting for its end
+    open_spans = {}
+    next_id = 0
+    prev = None
+    ts = 0
+
+    def finish(begin, end_ts, end_args):
+        nonlocal next_id
+        args = dict(begin["args"])
+        args.update(end_args)
+        if begin["name"] in ASYNC:
+            next_id += 1
+            common = {"name": begin["name"], "cat": begin["name"], "id": next_id,
+                      "pid": 0, "tid": begin["tid"]}
+            events.append(dict(common, ph="b", ts=begin["ts"], args=args))
+            events.append(dict(common, ph="e", ts=end_ts))
+        else:
+            events.append(dict(begin, ph="X", dur=end_ts - begin["ts"], args=args))
+    for i in range(count):
+        stamp, event, slot, a, b = RECORD.unpack_from(data, HEADER.size + i * record_size)
+        # system_get_time() wraps every ~71 minutes
+        if prev is not None:
+            ts += (stamp - prev) & 0xffffffff
+        prev = stamp
+
+        if event >= len(EVENTS) or not EVENTS[event]:
+            sys.stderr.write("tracedump: unknown event %d\n" % event)
+            continue
+        name, argnames = EVENTS[event]
+        values = (a, signed(b) if name == "tcp_write" else b)
+        if name == "handler" and a == NO_ROUTE:
+            values = (None, b)
+        ev = {
+            "name": name,
+            "ts": ts,
+            "pid": 0,
+            "tid": slot,
+            "args": dict(zip(argnames, values)),
+        }
+        slots.add(slot)
+        if name in BEGIN:
+            key = (slot, BEGIN[name])
+            # The end was lost (e.g. the connection was aborted)
+            if key in open_spans:
+                finish(open_spans.pop(key), ts, {"unfinished": True})
+            ev["name"] = BEGIN[name]
+            open_spans[key] = ev
+            continue
+        if name in END and (slot, END[name]) in open_spans:
+            finish(open_spans.pop((slot, END[name])), ts, ev["args"])
+            continue
+        # A connection closing ends whatever it was in the middle of
+        if name == "close":
+            for key in [k for k in open_spans if k[0] == slot]:
+                finish(open_spans.pop(key), ts, {"unfinished": True})
+        # Instant events, and ends whose begin was overwritten
+        ev["ph"] = "i"
+        ev["s"] = "t"
+        events.append(ev)
+
+    for begin in open_spans.values():
+        finish(begin, ts, {"unfinished": True})
+
+    for slot in sorted(slots):
+        events.append({
+            "name": "thread_name",
+            "ph": "M",
+            "pid": 0,
+            "tid": slot,
+            "args": {"name": "server" if slot == NO_SLOT else "slot %d" % slot},
+        })
+
+    out = json.dumps({"traceEvents": events, "displayTimeUnit": "ms"}, indent=1)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(out)
+    else:
+        print(out)
+
+if __name__ == "__main__":
+    main()